@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+static size_t bench_allocs = 0;
+
+static void* bench_malloc(size_t size)
+{
+  bench_allocs++;
+  return malloc(size);
+}
+
+#define BIBTEX_MALLOC(size) bench_malloc(size)
+#define BIBTEX_IMPLEMENTATION
+#include "../bibtex.h"
+
+#define BIBGEN_IMPLEMENTATION
+#include "bibgen.h"
+
+#define BENCH_LOOKUPS 1000
+
+static const char* bench_queries[] = { "quantum", "graph networks", "pars*", "knuth dijkstra", "dist* algorithms" };
+static const char* bench_filter = "type in {article, inproceedings} and year >= 2015 and journal ~ \"physics\"";
+static int bench_threads = 1;
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long bench_peak_rss_kb(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static size_t bench_parse_size(const char* str)
+{
+  char* end;
+  double value = strtod(str, &end);
+  switch(*end)
+    {
+    case 'k': case 'K': value *= 1024.0; break;
+    case 'm': case 'M': value *= 1024.0 * 1024.0; break;
+    case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+    }
+  return (size_t)value;
+}
+
+static void bench_parse_range(const char* str, int* min, int* max)
+{
+  if (sscanf(str, "%d:%d", min, max) == 1) *max = *min;
+}
+
+static const bibtex_entry_t* bench_find_key(const bibtex_entry_t* e, const char* key)
+{
+  while(e != NULL)
+    {
+      if (strcmp(e->key, key) == 0) return e;
+      e = e->next;
+    }
+  return NULL;
+}
+
+#ifdef BIBTEX_STATS
+static void bench_stats(const char* input)
+{
+  bibtex_entry_t* root;
+  bibtex_stats_t stats;
+  int i;
+  bibtex_parse_stats(&root, input, NULL, &stats);
+  bibtex_entry_free(root);
+  printf("%10s stats: %zu bytes scanned, %zu entries, %zu fields, %zu allocations (%zu bytes), %zu duplicate probes\n",
+         "", stats.bytes_scanned, stats.entries, stats.fields, stats.allocations, stats.bytes_allocated, stats.duplicate_probes);
+  printf("%10s tokens:", "");
+  for (i = 0; i < BIBTEX_STATS_TOKEN_TYPES; i++)
+    if (stats.tokens[i] > 0) printf(" %s=%zu", bibtex_stats_token_to_string(i), stats.tokens[i]);
+  printf("\n%10s phases:", "");
+  for (i = 0; i < BIBTEX_STATS_PHASES; i++)
+    printf(" %s=%.3fms", bibtex_stats_phase_to_string(i), stats.seconds[i] * 1e3);
+  printf("\n");
+}
+#endif
+
+static int bench_run(const bibgen_config_t* config, int repeats)
+{
+  size_t len, entries;
+  char* input = bibgen_generate_string(config, &len, &entries);
+  double parse_best = 0, free_best = 0;
+  size_t allocs = 0;
+  double lookup_time = 0, field_time = 0, merge_time = 0, index_time = 0, search_time = 0;
+  size_t terms = 0, hits = 0;
+  double select_time = 0, filter_time = 0;
+  size_t selected = 0, filtered = 0;
+  size_t found = 0, titles = 0, dropped = 0;
+  int i;
+  for (i = 0; i < repeats; i++)
+    {
+      bibtex_entry_t* root;
+      bench_allocs = 0;
+      double start = bench_now();
+      bibtex_error_t error = bibtex_parse(&root, input);
+      double parsed = bench_now();
+      if (error.type != BIBTEX_OK) {
+        fprintf(stderr, "Error at %d:%d: %s\n", error.row, error.col, bibtex_strerror(error.type));
+        free(input);
+        return -1;
+      }
+      allocs = bench_allocs;
+
+      if (i == repeats - 1)
+        {
+          unsigned long long state = config->seed;
+          char key[64];
+          double lookup_start = bench_now();
+          int j;
+          for (j = 0; j < BENCH_LOOKUPS; j++)
+            {
+              snprintf(key, sizeof(key), "key%zu", (size_t)(bibgen_next(&state) % entries));
+              found += bench_find_key(root, key) != NULL;
+            }
+          lookup_time = bench_now() - lookup_start;
+          double field_start = bench_now();
+          const bibtex_entry_t* e;
+          for (e = root; e != NULL; e = e->next)
+            {
+              const bibtex_field_t* f;
+              for (f = e->fields; f != NULL; f = f->next)
+                if (f->type == BIBTEX_FIELD_TYPE_TITLE) {
+                  titles++;
+                  break;
+                }
+            }
+          field_time = bench_now() - field_start;
+
+          bibtex_index_t index;
+          size_t q;
+          double index_start = bench_now();
+          bibtex_index_build(&index, root, BIBTEX_FIELD_MASK(BIBTEX_FIELD_TYPE_TITLE) | BIBTEX_FIELD_MASK(BIBTEX_FIELD_TYPE_AUTHOR)
+                             | BIBTEX_FIELD_MASK(BIBTEX_FIELD_TYPE_JOURNAL), bench_threads, NULL);
+          index_time = bench_now() - index_start;
+          terms = index.term_count;
+          double search_start = bench_now();
+          for (q = 0; q < sizeof(bench_queries) / sizeof(bench_queries[0]); q++)
+            {
+              size_t* ids;
+              hits += bibtex_index_search(&index, bench_queries[q], BIBTEX_FIELD_MASK_ALL, BIBTEX_INDEX_AND, &ids);
+              bibtex_index_results_free(&index, ids);
+            }
+          search_time = (bench_now() - search_start) / (sizeof(bench_queries) / sizeof(bench_queries[0]));
+          bibtex_index_free(&index);
+
+          bibtex_query_t* query;
+          bibtex_entry_t* kept;
+          size_t* ids;
+          const bibtex_entry_t* k;
+          bibtex_query_compile(&query, bench_filter, NULL);
+          double select_start = bench_now();
+          selected = bibtex_query_select(query, root, bench_threads, &ids);
+          select_time = bench_now() - select_start;
+          bibtex_query_results_free(query, ids);
+          double filter_start = bench_now();
+          bibtex_parse_query(&kept, input, query, NULL);
+          filter_time = bench_now() - filter_start;
+          for (k = kept; k != NULL; k = k->next) filtered++;
+          bibtex_entry_free(kept);
+          bibtex_query_free(query);
+
+          bibtex_entry_t* libraries[2];
+          bibtex_entry_t* merged;
+          libraries[0] = root;
+          bibtex_parse(&libraries[1], input);
+          double merge_start = bench_now();
+          dropped = bibtex_merge(&merged, libraries, 2, BIBTEX_MERGE_FIELDS, NULL);
+          merge_time = bench_now() - merge_start;
+          root = merged;
+        }
+
+      double free_start = bench_now();
+      bibtex_entry_free(root);
+      double freed = bench_now();
+      if (i == 0 || parsed - start < parse_best) parse_best = parsed - start;
+      if (i == 0 || freed - free_start < free_best) free_best = freed - free_start;
+    }
+  double mb = len / (1024.0 * 1024.0);
+  printf("%10zu bytes %9zu entries  parse: %8.3f ms %8.1f MB/s %11.0f entries/s  free: %8.3f ms  allocs/entry: %5.2f  peak rss: %ld KB\n",
+         len, entries, parse_best * 1e3, mb / parse_best, entries / parse_best, free_best * 1e3,
+         (double)allocs / entries, bench_peak_rss_kb());
+  printf("%10s citekey lookup: %10.2f us/op (%zu/%d found)  title scan: %8.3f ms (%zu titles)  self-merge: %8.3f ms (%zu dropped)\n",
+         "", lookup_time * 1e6 / BENCH_LOOKUPS, found, BENCH_LOOKUPS, field_time * 1e3, titles, merge_time * 1e3, dropped);
+  printf("%10s index build: %8.3f ms (%zu terms, %d threads)  search: %8.2f us/query (%zu hits)\n",
+         "", index_time * 1e3, terms, bench_threads, search_time * 1e6, hits);
+  printf("%10s query select: %8.3f ms (%zu matches)  filtered parse: %8.3f ms (%zu kept)\n",
+         "", select_time * 1e3, selected, filter_time * 1e3, filtered);
+#ifdef BIBTEX_STATS
+  bench_stats(input);
+#endif
+  free(input);
+  return 0;
+}
+
+static void bench_usage(const char* prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -s SIZE      corpus size, may be repeated (suffix K, M or G, default 1K..64M)\n"
+          "  -S SEED      generator seed (default 42)\n"
+          "  -f MIN:MAX   fields per entry (default 3:10)\n"
+          "  -l MIN:MAX   string value length (default 4:80)\n"
+          "  -d RATIO     ratio of entries duplicating an earlier DOI (default 0)\n"
+          "  -t TYPE=W    weight of an entry type, may be repeated (default uniform)\n"
+          "  -r REPEATS   parse repetitions per size (default 5)\n"
+          "  -j THREADS   index build and query threads, needs -DBIBTEX_THREADS (default 1)\n"
+          "  -o FILE      write the corpus of the last size to FILE and exit\n",
+          prog);
+}
+
+int main(int argc, char** argv)
+{
+  bibgen_config_t config;
+  size_t sizes[32];
+  int nsizes = 0;
+  int repeats = 5;
+  const char* output = NULL;
+  int i;
+  bibgen_config_default(&config);
+  for (i = 1; i < argc; i++)
+    {
+      if (i + 1 >= argc) {
+        bench_usage(argv[0]);
+        return 1;
+      }
+      const char* arg = argv[++i];
+      switch(argv[i - 1][0] == '-' ? argv[i - 1][1] : 0)
+        {
+        case 's':
+          if (nsizes < 32) sizes[nsizes++] = bench_parse_size(arg);
+          break;
+        case 'S': config.seed = strtoull(arg, NULL, 10); break;
+        case 'f': bench_parse_range(arg, &config.min_fields, &config.max_fields); break;
+        case 'l': bench_parse_range(arg, &config.min_value_len, &config.max_value_len); break;
+        case 'd': config.duplicate_ratio = strtod(arg, NULL); break;
+        case 'r': repeats = atoi(arg) > 0 ? atoi(arg) : 1; break;
+        case 'o': output = arg; break;
+        case 'j':
+          bench_threads = atoi(arg) > 0 ? atoi(arg) : 1;
+#ifndef BIBTEX_THREADS
+          if (bench_threads > 1) fprintf(stderr, "%s: -j needs -DBIBTEX_THREADS, using 1 thread\n", argv[0]);
+          bench_threads = 1;
+#endif
+          break;
+        case 't':
+          {
+            const char* eq = strchr(arg, '=');
+            int t;
+            for (t = 0; eq != NULL && t < BIBGEN_ENTRY_TYPE_COUNT; t++)
+              if (strncmp(arg, bibgen_entry_types[t], eq - arg) == 0 && bibgen_entry_types[t][eq - arg] == '\0')
+                config.type_weights[t] = atoi(eq + 1);
+            break;
+          }
+        default:
+          bench_usage(argv[0]);
+          return 1;
+        }
+    }
+  if (nsizes == 0)
+    {
+      size_t size;
+      for (size = 1024; size <= 64 * 1024 * 1024; size *= 4) sizes[nsizes++] = size;
+    }
+
+  if (output != NULL)
+    {
+      FILE* file = fopen(output, "wb");
+      size_t entries;
+      if (file == NULL) {
+        perror(output);
+        return 1;
+      }
+      config.target_bytes = sizes[nsizes - 1];
+      size_t written = bibgen_generate_file(&config, file, &entries);
+      fclose(file);
+      printf("%s: %zu bytes, %zu entries\n", output, written, entries);
+      return 0;
+    }
+
+  for (i = 0; i < nsizes; i++)
+    {
+      config.target_bytes = sizes[i];
+      if (bench_run(&config, repeats) != 0) return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,241 @@
+#ifndef __BIBGEN_H__
+#define __BIBGEN_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BIBGEN_ENTRY_TYPE_COUNT 14
+#define BIBGEN_FIELD_TYPE_COUNT 26
+
+typedef struct bibgen_config_t
+{
+  unsigned long long seed;
+  size_t target_bytes; // generation stops once at least this many bytes were written
+  unsigned type_weights[BIBGEN_ENTRY_TYPE_COUNT]; // relative weights, all zero means uniform
+  int min_fields;
+  int max_fields;
+  int min_value_len;
+  int max_value_len;
+  double duplicate_ratio; // fraction of entries with a fresh citekey but the DOI of an earlier entry
+} bibgen_config_t;
+
+typedef int (*bibgen_write_fn)(const char* data, size_t len, void* user);
+
+void bibgen_config_default(bibgen_config_t* config);
+size_t bibgen_generate(const bibgen_config_t* config, bibgen_write_fn write, void* user, size_t* entries);
+char* bibgen_generate_string(const bibgen_config_t* config, size_t* len, size_t* entries);
+size_t bibgen_generate_file(const bibgen_config_t* config, FILE* file, size_t* entries);
+
+#ifdef BIBGEN_IMPLEMENTATION
+
+static const char* bibgen_entry_types[BIBGEN_ENTRY_TYPE_COUNT] = {
+  "article", "book", "booklet", "conference", "inbook", "incollection", "inproceedings",
+  "manual", "mastersthesis", "misc", "phdthesis", "proceedings", "techreport", "unpublished",
+};
+
+static const char* bibgen_field_types[BIBGEN_FIELD_TYPE_COUNT] = {
+  "address", "annote", "author", "booktitle", "chapter", "doi", "edition", "editor",
+  "howpublished", "institution", "issn", "isbn", "journal", "month", "note", "number",
+  "organization", "pages", "publisher", "school", "type", "series", "title", "url",
+  "volume", "year",
+};
+
+static const char* bibgen_words[] = {
+  "analysis", "of", "the", "quantum", "theory", "on", "a", "method", "for", "fast",
+  "parsing", "large", "scale", "systems", "learning", "graph", "and", "networks", "with",
+  "applications", "to", "physics", "data", "structures", "distributed", "algorithms",
+  "Knuth", "Donald", "Lamport", "Leslie", "Dijkstra", "Edsger", "Hoare", "Tony",
+};
+
+struct bibgen_buffer_t
+{
+  char* data;
+  size_t len;
+  size_t cap;
+};
+
+static unsigned long long bibgen_next(unsigned long long* state)
+{
+  unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static int bibgen_range(unsigned long long* state, int min, int max)
+{
+  if (max <= min) return min;
+  return min + (int)(bibgen_next(state) % (unsigned long long)(max - min + 1));
+}
+
+static double bibgen_unit(unsigned long long* state)
+{
+  return (bibgen_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void bibgen_buffer_append(struct bibgen_buffer_t* buf, const char* data, size_t len)
+{
+  if (buf->len + len > buf->cap)
+    {
+      size_t cap = buf->cap ? buf->cap : 256;
+      while(cap < buf->len + len) cap *= 2;
+      buf->data = realloc(buf->data, cap);
+      buf->cap = cap;
+    }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void bibgen_buffer_puts(struct bibgen_buffer_t* buf, const char* str)
+{
+  bibgen_buffer_append(buf, str, strlen(str));
+}
+
+static int bibgen_pick_type(const bibgen_config_t* config, unsigned long long* state)
+{
+  unsigned long long total = 0;
+  int i;
+  for (i = 0; i < BIBGEN_ENTRY_TYPE_COUNT; i++) total += config->type_weights[i];
+  if (total == 0) return bibgen_range(state, 0, BIBGEN_ENTRY_TYPE_COUNT - 1);
+  unsigned long long pick = bibgen_next(state) % total;
+  for (i = 0; i < BIBGEN_ENTRY_TYPE_COUNT; i++)
+    {
+      if (pick < config->type_weights[i]) return i;
+      pick -= config->type_weights[i];
+    }
+  return BIBGEN_ENTRY_TYPE_COUNT - 1;
+}
+
+static void bibgen_value(struct bibgen_buffer_t* buf, const bibgen_config_t* config, unsigned long long* state)
+{
+  int len = bibgen_range(state, config->min_value_len, config->max_value_len);
+  int written = 0;
+  bibgen_buffer_puts(buf, "\"");
+  while(written < len)
+    {
+      const char* word = bibgen_words[bibgen_next(state) % (sizeof(bibgen_words) / sizeof(bibgen_words[0]))];
+      size_t word_len = strlen(word);
+      if (written > 0) {
+        if (written + 1 >= len) break;
+        bibgen_buffer_puts(buf, " ");
+        written++;
+      }
+      if (written + (int)word_len > len) word_len = len - written;
+      bibgen_buffer_append(buf, word, word_len);
+      written += word_len;
+    }
+  bibgen_buffer_puts(buf, "\"");
+}
+
+static void bibgen_entry(struct bibgen_buffer_t* buf, const bibgen_config_t* config, unsigned long long* state, size_t index)
+{
+  char tmp[64];
+  int order[BIBGEN_FIELD_TYPE_COUNT];
+  int i;
+  // Citekeys stay unique so the corpus parses. With duplicates every entry gets a DOI and a
+  // duplicate copies the DOI of an earlier entry, which is what bibtex_merge deduplicates on.
+  // The DOI is never drawn as a random field, so entries only share one when they are duplicates.
+  int dois = config->duplicate_ratio > 0;
+  int fields = BIBGEN_FIELD_TYPE_COUNT;
+  size_t doi = index;
+  if (dois && index > 0 && bibgen_unit(state) < config->duplicate_ratio)
+    doi = bibgen_next(state) % index;
+  bibgen_buffer_puts(buf, "@");
+  bibgen_buffer_puts(buf, bibgen_entry_types[bibgen_pick_type(config, state)]);
+  snprintf(tmp, sizeof(tmp), "{key%zu,\n", index);
+  bibgen_buffer_puts(buf, tmp);
+
+  for (i = 0; i < BIBGEN_FIELD_TYPE_COUNT; i++) order[i] = i;
+  // keep the random fields away from the DOI by moving it past the drawn range
+  i = 0;
+  while(strcmp(bibgen_field_types[order[i]], "doi") != 0) i++;
+  int doi_field = order[i];
+  order[i] = order[fields - 1];
+  order[--fields] = doi_field;
+  int count = bibgen_range(state, config->min_fields, config->max_fields);
+  if (count > fields) count = fields;
+  if (dois) {
+    snprintf(tmp, sizeof(tmp), "  doi = \"10.5555/bibgen.%zu\"%s\n", doi, count > 0 ? "," : "");
+    bibgen_buffer_puts(buf, tmp);
+  }
+  for (i = 0; i < count; i++)
+    {
+      int j = bibgen_range(state, i, fields - 1);
+      int field = order[j];
+      order[j] = order[i];
+      order[i] = field;
+      bibgen_buffer_puts(buf, "  ");
+      bibgen_buffer_puts(buf, bibgen_field_types[field]);
+      bibgen_buffer_puts(buf, " = ");
+      if (strcmp(bibgen_field_types[field], "year") == 0) {
+        snprintf(tmp, sizeof(tmp), "%d", bibgen_range(state, 1950, 2025));
+        bibgen_buffer_puts(buf, tmp);
+      } else if (strcmp(bibgen_field_types[field], "volume") == 0 || strcmp(bibgen_field_types[field], "number") == 0) {
+        snprintf(tmp, sizeof(tmp), "%d", bibgen_range(state, 1, 200));
+        bibgen_buffer_puts(buf, tmp);
+      } else bibgen_value(buf, config, state);
+      bibgen_buffer_puts(buf, i + 1 < count ? ",\n" : "\n");
+    }
+  bibgen_buffer_puts(buf, "}\n");
+}
+
+void bibgen_config_default(bibgen_config_t* config)
+{
+  memset(config, 0, sizeof(*config));
+  config->seed = 42;
+  config->target_bytes = 1024 * 1024;
+  config->min_fields = 3;
+  config->max_fields = 10;
+  config->min_value_len = 4;
+  config->max_value_len = 80;
+  config->duplicate_ratio = 0.0;
+}
+
+size_t bibgen_generate(const bibgen_config_t* config, bibgen_write_fn write, void* user, size_t* entries)
+{
+  struct bibgen_buffer_t buf = {NULL, 0, 0};
+  unsigned long long state = config->seed;
+  size_t total = 0;
+  size_t index = 0;
+  do
+    {
+      buf.len = 0;
+      bibgen_entry(&buf, config, &state, index++);
+      if (write(buf.data, buf.len, user) != 0) break;
+      total += buf.len;
+    }
+  while(total < config->target_bytes);
+  free(buf.data);
+  if (entries != NULL) *entries = index;
+  return total;
+}
+
+static int bibgen_write_buffer(const char* data, size_t len, void* user)
+{
+  bibgen_buffer_append(user, data, len);
+  return 0;
+}
+
+char* bibgen_generate_string(const bibgen_config_t* config, size_t* len, size_t* entries)
+{
+  struct bibgen_buffer_t buf = {NULL, 0, 0};
+  bibgen_generate(config, bibgen_write_buffer, &buf, entries);
+  bibgen_buffer_append(&buf, "", 1);
+  if (len != NULL) *len = buf.len - 1;
+  return buf.data;
+}
+
+static int bibgen_write_file(const char* data, size_t len, void* user)
+{
+  return fwrite(data, 1, len, user) == len ? 0 : -1;
+}
+
+size_t bibgen_generate_file(const bibgen_config_t* config, FILE* file, size_t* entries)
+{
+  return bibgen_generate(config, bibgen_write_file, file, entries);
+}
+
+#endif // BIBGEN_IMPLEMENTATION
+
+#endif // __BIBGEN_H__
@@ -5,6 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#ifdef BIBTEX_THREADS
+#include <pthread.h>
+#endif
+#ifdef BIBTEX_STATS
+#include <time.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum bibtex_error_type_t
 {
@@ -27,6 +38,8 @@ typedef enum bibtex_error_type_t
   BIBTEX_ERROR_INVALID_FIELD_TYPE  = 1 << 13,
   BIBTEX_ERROR_DUPLICATE_CITEKEY   = 1 << 14,
   BIBTEX_ERROR_DUPLICATE_FIELD     = 1 << 15,
+
+  BIBTEX_ERROR_INVALID_QUERY       = 1 << 16,
 } bibtex_error_type_t;
 
 typedef enum bibtex_entry_type_t
@@ -75,6 +88,7 @@ typedef enum bibtex_field_type_t
   BIBTEX_FIELD_TYPE_URL,
   BIBTEX_FIELD_TYPE_VOLUME,
   BIBTEX_FIELD_TYPE_YEAR,
+  BIBTEX_FIELD_TYPE_CROSSREF,
 } bibtex_field_type_t;
 
 typedef struct bibtex_error_t
@@ -84,10 +98,32 @@ typedef struct bibtex_error_t
   int col;
 } bibtex_error_t;
 
+typedef struct bibtex_range_t
+{
+  size_t start; // offset into the field value
+  size_t length;
+} bibtex_range_t;
+
+typedef struct bibtex_name_t
+{
+  bibtex_range_t first;
+  bibtex_range_t von;
+  bibtex_range_t last;
+  bibtex_range_t jr;
+} bibtex_name_t;
+
+typedef struct bibtex_name_list_t
+{
+  size_t count;
+  bibtex_name_t* names;
+} bibtex_name_list_t;
+
 typedef struct bibtex_field_t
 {
   bibtex_field_type_t type;
   char* value;
+  char* utf8; // decoded value cached by bibtex_field_utf8, may point to value
+  bibtex_name_list_t* names; // name list cached by bibtex_field_names
   struct bibtex_field_t* next;
 } bibtex_field_t;
 
@@ -96,19 +132,195 @@ typedef struct bibtex_entry_t
   bibtex_entry_type_t type;
   char* key;
   bibtex_field_t* fields;
+  struct bibtex_entry_t* parent; // crossref target set by bibtex_crossref_resolve
+  size_t crossrefs; // number of entries resolved to this one
   struct bibtex_entry_t* next;
 } bibtex_entry_t;
 
+typedef enum bibtex_merge_policy_t
+{
+  BIBTEX_MERGE_KEEP_FIRST,
+  BIBTEX_MERGE_KEEP_LAST,
+  BIBTEX_MERGE_FIELDS, // keep the first entry and add the fields it is missing
+} bibtex_merge_policy_t;
+
+typedef struct bibtex_allocator_t
+{
+  void* (*malloc_fn)(void* user, size_t size);
+  void* (*realloc_fn)(void* user, void* ptr, size_t size);
+  void (*free_fn)(void* user, void* ptr);
+  void* user;
+} bibtex_allocator_t;
+
+#define BIBTEX_FIELD_MASK(type) (1UL << (type))
+#define BIBTEX_FIELD_MASK_ALL (~0UL)
+
+typedef enum bibtex_index_mode_t
+{
+  BIBTEX_INDEX_AND,
+  BIBTEX_INDEX_OR,
+} bibtex_index_mode_t;
+
+typedef struct bibtex_index_term_t
+{
+  uint32_t offset; // case-folded term in strings
+  uint32_t length;
+  uint32_t field;
+  uint32_t count;
+  uint64_t postings; // offset of the delta and varint encoded entry ids
+} bibtex_index_term_t;
+
+typedef struct bibtex_index_t
+{
+  size_t entries;
+  bibtex_index_term_t* terms; // sorted by term, then field
+  size_t term_count;
+  char* strings;
+  size_t strings_len;
+  unsigned char* postings;
+  size_t postings_len;
+  const bibtex_allocator_t* allocator;
+} bibtex_index_t;
+
+// Compiled filter program, see bibtex_query_compile.
+typedef struct bibtex_query_t bibtex_query_t;
+
+#ifdef BIBTEX_STATS
+#define BIBTEX_STATS_TOKEN_TYPES 11
+
+typedef enum bibtex_stats_phase_t
+{
+  BIBTEX_STATS_PHASE_LEX,
+  BIBTEX_STATS_PHASE_CLASSIFY,
+  BIBTEX_STATS_PHASE_DUPLICATES,
+  BIBTEX_STATS_PHASE_BUILD,
+  BIBTEX_STATS_PHASE_TOTAL,
+  BIBTEX_STATS_PHASES,
+} bibtex_stats_phase_t;
+
+typedef struct bibtex_stats_t
+{
+  size_t tokens[BIBTEX_STATS_TOKEN_TYPES]; // indexed like bibtex_stats_token_to_string
+  size_t bytes_scanned;
+  size_t entries;
+  size_t fields;
+  size_t allocations;
+  size_t bytes_allocated;
+  size_t duplicate_probes; // citekey and field comparisons made by duplicate checks
+  double seconds[BIBTEX_STATS_PHASES];
+} bibtex_stats_t;
+
+bibtex_error_t bibtex_parse_stats(bibtex_entry_t** root, const char* input, const bibtex_allocator_t* allocator, bibtex_stats_t* stats);
+const char* bibtex_stats_token_to_string(int type);
+const char* bibtex_stats_phase_to_string(bibtex_stats_phase_t phase);
+#endif
+
 bibtex_error_t bibtex_parse(bibtex_entry_t** root, const char* input);
+bibtex_error_t bibtex_parse_with(bibtex_entry_t** root, const char* input, const bibtex_allocator_t* allocator);
+bibtex_error_t bibtex_parse_query(bibtex_entry_t** root, const char* input, const bibtex_query_t* query, const bibtex_allocator_t* allocator);
 void bibtex_field_free(bibtex_field_t* field);
+void bibtex_field_free_with(bibtex_field_t* field, const bibtex_allocator_t* allocator);
+// The decoded value is cached in the field and freed with it, so allocator must be the one the
+// field's entry was parsed with and will be freed with (NULL for bibtex_parse/bibtex_entry_free).
+const char* bibtex_field_utf8(bibtex_field_t* field, const bibtex_allocator_t* allocator);
+// Cached like bibtex_field_utf8, with the same rule for allocator.
+const bibtex_name_list_t* bibtex_field_names(bibtex_field_t* field, const bibtex_allocator_t* allocator);
 void bibtex_entry_free(bibtex_entry_t* entry);
+void bibtex_entry_free_with(bibtex_entry_t* entry, const bibtex_allocator_t* allocator);
+bibtex_field_t* bibtex_entry_field(const bibtex_entry_t* entry, bibtex_field_type_t type);
+// Entries already in *hidden are moved back to the end of *root first, so calling it again
+// re-resolves the whole library with the new min_crossrefs.
+size_t bibtex_crossref_resolve(bibtex_entry_t** root, bibtex_entry_t** hidden, size_t min_crossrefs, const bibtex_allocator_t* allocator);
+// Dropped duplicates are freed. Parent pointers of the merged entries that pointed at a dropped
+// entry are moved to the entry it was merged into; entries outside libraries (e.g. a hidden list)
+// are not updated, resolve crossrefs again if they may point into libraries.
+size_t bibtex_merge(bibtex_entry_t** root, bibtex_entry_t** libraries, size_t count, bibtex_merge_policy_t policy, const bibtex_allocator_t* allocator);
+int bibtex_index_build(bibtex_index_t* index, const bibtex_entry_t* root, unsigned long fields, int threads, const bibtex_allocator_t* allocator);
+size_t bibtex_index_search(const bibtex_index_t* index, const char* query, unsigned long fields, bibtex_index_mode_t mode, size_t** ids);
+void bibtex_index_results_free(const bibtex_index_t* index, size_t* ids);
+int bibtex_index_save(const bibtex_index_t* index, FILE* file);
+int bibtex_index_load(bibtex_index_t* index, FILE* file, const bibtex_allocator_t* allocator);
+void bibtex_index_free(bibtex_index_t* index);
+bibtex_error_t bibtex_query_compile(bibtex_query_t** query, const char* text, const bibtex_allocator_t* allocator);
+int bibtex_query_match(const bibtex_query_t* query, const bibtex_entry_t* entry);
+size_t bibtex_query_select(const bibtex_query_t* query, const bibtex_entry_t* root, int threads, size_t** ids);
+void bibtex_query_results_free(const bibtex_query_t* query, size_t* ids);
+void bibtex_query_free(bibtex_query_t* query);
 const char* bibtex_strerror(bibtex_error_type_t type);
 const char* bibtex_entry_type_to_string(bibtex_entry_type_t type);
 const char* bibtex_field_type_to_string(bibtex_field_type_t type);
 
+#ifdef __cplusplus
+}
+#endif
+
 #ifdef BIBTEX_IMPLEMENTATION
 
+#ifdef __cplusplus
+#error "the bibtex.h implementation must be compiled as C"
+#endif
+
+#ifndef BIBTEX_MALLOC
+#define BIBTEX_MALLOC(size) malloc(size)
+#endif
+#ifndef BIBTEX_REALLOC
+#define BIBTEX_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+#ifndef BIBTEX_FREE
+#define BIBTEX_FREE(ptr) free(ptr)
+#endif
+
 #define bibtex_if_token_error_break(tok, old_err, new_err) old_err = new_err;  if (tok == BIBTOKEN_TYPE_ERROR) goto clean_up;
+// Same, for lookaheads taken while the previous token's value is not owned by an entry yet.
+#define bibtex_if_token_error_free_break(lex, tok, old_err, new_err, pending) old_err = new_err;  if (tok == BIBTOKEN_TYPE_ERROR) { biblexer_free(lex, pending); goto clean_up; }
+
+#ifdef BIBTEX_STATS
+#ifndef BIBTEX_STATS_NOW
+#define BIBTEX_STATS_NOW() bibtex_stats_now()
+static double bibtex_stats_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
+#define bibtex_stats_add(stats, member, n) do { if ((stats) != NULL) (stats)->member += (n); } while(0)
+// Declares start, so unlike its siblings it is a declaration and cannot be wrapped.
+#define bibtex_stats_begin(stats, start) double start = (stats) != NULL ? BIBTEX_STATS_NOW() : 0
+#define bibtex_stats_end(stats, start, phase) do { if ((stats) != NULL) (stats)->seconds[phase] += BIBTEX_STATS_NOW() - start; } while(0)
+#else
+#define bibtex_stats_add(stats, member, n) do { } while(0)
+#define bibtex_stats_begin(stats, start)
+#define bibtex_stats_end(stats, start, phase) do { } while(0)
+#endif
+
+static void* bibtex_malloc(const struct bibtex_allocator_t* allocator, size_t size)
+{
+  if (allocator != NULL) return allocator->malloc_fn(allocator->user, size);
+  return BIBTEX_MALLOC(size);
+}
+
+static void* bibtex_realloc(const struct bibtex_allocator_t* allocator, void* ptr, size_t size)
+{
+  if (allocator != NULL) return allocator->realloc_fn(allocator->user, ptr, size);
+  return BIBTEX_REALLOC(ptr, size);
+}
+
+static void bibtex_grow(const struct bibtex_allocator_t* allocator, void* data, size_t* cap, size_t need, size_t size)
+{
+  if (need <= *cap) return;
+  size_t new_cap = *cap ? *cap : 16;
+  while(new_cap < need) new_cap *= 2;
+  *(void**)data = bibtex_realloc(allocator, *(void**)data, new_cap * size);
+  *cap = new_cap;
+}
+
+static void bibtex_free(const struct bibtex_allocator_t* allocator, void* ptr)
+{
+  if (ptr == NULL) return;
+  if (allocator != NULL) allocator->free_fn(allocator->user, ptr);
+  else BIBTEX_FREE(ptr);
+}
 
 static void bibtex_error_init(struct bibtex_error_t* error, enum bibtex_error_type_t type, int row, int col)
 {
@@ -121,9 +333,14 @@ struct biblexer_t
 {
   const char* input;
   struct bibtex_error_t error;
-  int pos;
+  size_t pos;
   int row;
   int col;
+  const struct bibtex_allocator_t* allocator;
+  const struct bibtex_query_t* query; // entries not matching it are dropped at their closing brace
+#ifdef BIBTEX_STATS
+  struct bibtex_stats_t* stats;
+#endif
 };
 
 enum bibtoken_type_t
@@ -149,32 +366,54 @@ struct bibtoken_t
   int col;
 };
 
-static struct bibtex_entry_t* bibtex_entry_init(enum bibtex_entry_type_t type, char* key)
+static void* biblexer_malloc(struct biblexer_t* lex, size_t size)
+{
+  bibtex_stats_add(lex->stats, allocations, 1);
+  bibtex_stats_add(lex->stats, bytes_allocated, size);
+  return bibtex_malloc(lex->allocator, size);
+}
+
+static void biblexer_free(struct biblexer_t* lex, void* ptr)
 {
-  struct bibtex_entry_t* entry = malloc(sizeof(struct bibtex_entry_t));
+  bibtex_free(lex->allocator, ptr);
+}
+
+static struct bibtex_entry_t* bibtex_entry_init(struct biblexer_t* lex, enum bibtex_entry_type_t type, char* key)
+{
+  bibtex_stats_begin(lex->stats, start);
+  bibtex_stats_add(lex->stats, entries, 1);
+  struct bibtex_entry_t* entry = biblexer_malloc(lex, sizeof(struct bibtex_entry_t));
   entry->type = type;
   entry->key = key;
   entry->fields = NULL;
+  entry->parent = NULL;
+  entry->crossrefs = 0;
   entry->next = NULL;
+  bibtex_stats_end(lex->stats, start, BIBTEX_STATS_PHASE_BUILD);
   return entry;
 }
 
-static struct bibtex_field_t* bibtex_field_init(enum bibtex_field_type_t type, char* value)
+static struct bibtex_field_t* bibtex_field_init(struct biblexer_t* lex, enum bibtex_field_type_t type, char* value)
 {
-  struct bibtex_field_t* field = malloc(sizeof(struct bibtex_field_t));
+  bibtex_stats_begin(lex->stats, start);
+  bibtex_stats_add(lex->stats, fields, 1);
+  struct bibtex_field_t* field = biblexer_malloc(lex, sizeof(struct bibtex_field_t));
   field->type = type;
   field->value = value;
+  field->utf8 = NULL;
+  field->names = NULL;
   field->next = NULL;
+  bibtex_stats_end(lex->stats, start, BIBTEX_STATS_PHASE_BUILD);
   return field;
 }
 
-static struct bibtoken_t bibtoken_init_value(enum bibtoken_type_t type, const char* start, size_t len, int row, int col)
+static struct bibtoken_t bibtoken_init_value(struct biblexer_t* lex, enum bibtoken_type_t type, const char* start, size_t len, int row, int col)
 {
   struct bibtoken_t token;
   token.type = type;
   token.row = row;
   token.col = col;
-  token.value = malloc(len + 1);
+  token.value = biblexer_malloc(lex, len + 1);
   memcpy(token.value, start, len);
   token.value[len] = '\0';
   return token;
@@ -190,16 +429,21 @@ static struct bibtoken_t bibtoken_init(enum bibtoken_type_t type, int row, int c
   return token;
 }
 
-static struct biblexer_t biblexer_init(const char* input)
+static struct biblexer_t biblexer_init(const char* input, const struct bibtex_allocator_t* allocator)
 {
   struct biblexer_t lex;
   lex.input = input;
+  lex.allocator = allocator;
+  lex.query = NULL;
   lex.pos = 0;
   lex.row = 1;
   lex.col = 1;
   lex.error.type = BIBTEX_OK;
   lex.error.row = 0;
   lex.error.col = 0;
+#ifdef BIBTEX_STATS
+  lex.stats = NULL;
+#endif
   return lex;
 }
 
@@ -233,24 +477,29 @@ static struct bibtoken_t biblexer_lex_id(struct biblexer_t* lex)
   int row = lex->row;
   int col = lex->col;
   while(isalnum(biblexer_peek(lex)) || biblexer_peek(lex) == '-' || biblexer_peek(lex) == '_' || biblexer_peek(lex) == ':') biblexer_advance(lex);
-  return bibtoken_init_value(BIBTOKEN_TYPE_ID, lex->input + start, lex->pos - start, row, col);
+  return bibtoken_init_value(lex, BIBTOKEN_TYPE_ID, lex->input + start, lex->pos - start, row, col);
 }
 
-// TODO: handle inner strings
 static struct bibtoken_t biblexer_lex_string(struct biblexer_t* lex)
 {
   int row = lex->row;
   int col = lex->col;
+  int depth = 0;
   biblexer_advance(lex);
   size_t start = lex->pos;
-  while(biblexer_peek(lex) != '\0' && biblexer_peek(lex) != '"') biblexer_advance(lex);
+  while(biblexer_peek(lex) != '\0' && (depth > 0 || biblexer_peek(lex) != '"'))
+    {
+      if (biblexer_peek(lex) == '{') depth++;
+      else if (biblexer_peek(lex) == '}' && depth > 0) depth--;
+      biblexer_advance(lex);
+    }
   if (biblexer_peek(lex) == '\0' && biblexer_peek(lex) != '"')
     {
       bibtex_error_init(&lex->error, BIBTEX_ERROR_UNTERMINATED_STRING, row, col);
       return bibtoken_init(BIBTOKEN_TYPE_ERROR, row, col);
     }
   size_t len = lex->pos - start;
-  return bibtoken_init_value(BIBTOKEN_TYPE_STRING, lex->input + start, len, row, col);
+  return bibtoken_init_value(lex, BIBTOKEN_TYPE_STRING, lex->input + start, len, row, col);
 }
 
 static struct bibtoken_t biblexer_lex_number(struct biblexer_t* lex)
@@ -259,10 +508,10 @@ static struct bibtoken_t biblexer_lex_number(struct biblexer_t* lex)
   int row = lex->row;
   int col = lex->col;
   while(isdigit(biblexer_peek(lex))) biblexer_advance(lex);
-  return bibtoken_init_value(BIBTOKEN_TYPE_NUMBER, lex->input + start, lex->pos - start, row, col);
+  return bibtoken_init_value(lex, BIBTOKEN_TYPE_NUMBER, lex->input + start, lex->pos - start, row, col);
 }
 
-static struct bibtoken_t biblexer_next_token(struct biblexer_t* lex)
+static struct bibtoken_t biblexer_scan_token(struct biblexer_t* lex)
 {
   biblexer_skip_whitespace(lex);
   char c = biblexer_peek(lex);
@@ -307,6 +556,15 @@ static struct bibtoken_t biblexer_next_token(struct biblexer_t* lex)
   return token;
 }
 
+static struct bibtoken_t biblexer_next_token(struct biblexer_t* lex)
+{
+  bibtex_stats_begin(lex->stats, start);
+  struct bibtoken_t token = biblexer_scan_token(lex);
+  bibtex_stats_add(lex->stats, tokens[token.type], 1);
+  bibtex_stats_end(lex->stats, start, BIBTEX_STATS_PHASE_LEX);
+  return token;
+}
+
 
 static int bibtex_compare_values(const char* v0, const char* v1)
 {
@@ -374,6 +632,7 @@ static enum bibtex_field_type_t bibtex_field_type_check(const char* value)
   if (bibtex_compare_values(value, "url")) return BIBTEX_FIELD_TYPE_URL;
   if (bibtex_compare_values(value, "volume")) return BIBTEX_FIELD_TYPE_VOLUME;
   if (bibtex_compare_values(value, "year")) return BIBTEX_FIELD_TYPE_YEAR;
+  if (bibtex_compare_values(value, "crossref")) return BIBTEX_FIELD_TYPE_CROSSREF;
   return -1;
 }
 
@@ -396,30 +655,174 @@ static enum bibtex_error_type_t bibtoken_to_error(enum bibtoken_type_t token)
     }
 }
 
-struct bibtex_key_t {
-    char* key;
-    struct bibtex_key_t* next;
+// Open addressing index from a normalised entry string (citekey, DOI) to the entry.
+// Slots keep the key the entry had when it was inserted, so bibtex_merge can swap the
+// contents of a kept entry without its earlier keys going stale; the strings must outlive the map.
+struct bibtex_map_slot_t {
+    size_t hash;
+    const char* key;
+    struct bibtex_entry_t* entry;
 };
 
+struct bibtex_map_t {
+    struct bibtex_map_slot_t* slots;
+    size_t cap;
+    size_t len;
+    const char* (*key_of)(const struct bibtex_entry_t* entry);
+    const struct bibtex_allocator_t* allocator;
+#ifdef BIBTEX_STATS
+    size_t probes;
+    size_t allocations; // slot arrays, added to the parse stats like probes
+    size_t bytes_allocated;
+#endif
+};
 
-static int bibtex_key_is_declared(struct bibtex_key_t* keys, char* key)
+// Case-folded FNV-1a that ignores trailing whitespace, matching bibtex_compare_keys.
+static size_t bibtex_hash_value(const char* value)
 {
-  while(keys != NULL)
+  size_t hash = 14695981039346656037ULL;
+  size_t trimmed = hash;
+  while(*value)
     {
-      if (bibtex_compare_values(keys->key, key)) return 1;
-      keys = keys->next;
+      unsigned char c = (unsigned char)*value++;
+      hash ^= (unsigned char)tolower(c);
+      hash *= 1099511628211ULL;
+      if (!isspace(c)) trimmed = hash;
     }
-  return 0;
+  return trimmed;
+}
+
+static int bibtex_compare_keys(const char* k0, const char* k1)
+{
+  while(*k0 && tolower((unsigned char)*k0) == tolower((unsigned char)*k1))
+    {
+      k0++;
+      k1++;
+    }
+  while(isspace((unsigned char)*k0)) k0++;
+  while(isspace((unsigned char)*k1)) k1++;
+  return *k0 == '\0' && *k1 == '\0';
+}
+
+static const char* bibtex_skip_prefix(const char* value, const char* prefix)
+{
+  const char* v = value;
+  while(*prefix && tolower((unsigned char)*v) == *prefix)
+    {
+      v++;
+      prefix++;
+    }
+  return *prefix ? value : v;
+}
+
+static const char* bibtex_entry_citekey(const struct bibtex_entry_t* entry)
+{
+  return entry->key;
+}
+
+static const char* bibtex_entry_doi(const struct bibtex_entry_t* entry)
+{
+  const struct bibtex_field_t* field = entry->fields;
+  while(field != NULL)
+    {
+      if (field->type == BIBTEX_FIELD_TYPE_DOI && field->value != NULL) {
+	const char* doi = field->value;
+	const char* rest;
+	while(isspace((unsigned char)*doi)) doi++;
+	rest = bibtex_skip_prefix(doi, "https://");
+	if (rest == doi) rest = bibtex_skip_prefix(doi, "http://");
+	if (rest != doi) {
+	  const char* host = bibtex_skip_prefix(rest, "dx.");
+	  const char* path = bibtex_skip_prefix(host, "doi.org/");
+	  if (path != host) doi = path;
+	} else if ((rest = bibtex_skip_prefix(doi, "doi:")) != doi) {
+	  doi = rest;
+	  while(isspace((unsigned char)*doi)) doi++;
+	}
+	// Trailing whitespace is ignored by bibtex_hash_value and bibtex_compare_keys.
+	return *doi ? doi : NULL;
+      }
+      field = field->next;
+    }
+  return NULL;
+}
+
+static struct bibtex_map_slot_t* bibtex_map_slots(struct bibtex_map_t* map)
+{
+  size_t size = map->cap * sizeof(struct bibtex_map_slot_t);
+  struct bibtex_map_slot_t* slots = bibtex_malloc(map->allocator, size);
+  bibtex_stats_add(map, allocations, 1);
+  bibtex_stats_add(map, bytes_allocated, size);
+  memset(slots, 0, size);
+  return slots;
+}
+
+static void bibtex_map_init(struct bibtex_map_t* map, const char* (*key_of)(const struct bibtex_entry_t*), size_t hint, const struct bibtex_allocator_t* allocator)
+{
+  map->cap = 16;
+  while(map->cap < hint * 2) map->cap *= 2;
+  map->len = 0;
+  map->key_of = key_of;
+  map->allocator = allocator;
+#ifdef BIBTEX_STATS
+  map->probes = 0;
+  map->allocations = 0;
+  map->bytes_allocated = 0;
+#endif
+  map->slots = bibtex_map_slots(map);
+}
+
+static void bibtex_map_free(struct bibtex_map_t* map)
+{
+  bibtex_free(map->allocator, map->slots);
+  map->slots = NULL;
+}
+
+static struct bibtex_entry_t* bibtex_map_find(struct bibtex_map_t* map, const char* key, size_t hash)
+{
+  size_t i = hash & (map->cap - 1);
+  while(map->slots[i].entry != NULL)
+    {
+      bibtex_stats_add(map, probes, 1);
+      if (map->slots[i].hash == hash && bibtex_compare_keys(map->slots[i].key, key)) return map->slots[i].entry;
+      i = (i + 1) & (map->cap - 1);
+    }
+  return NULL;
 }
 
-static void bibtex_key_free(struct bibtex_key_t* key)
+static void bibtex_map_insert(struct bibtex_map_t* map, struct bibtex_entry_t* entry, size_t hash)
 {
-  while(key != NULL)
+  if ((map->len + 1) * 4 > map->cap * 3)
     {
-      struct bibtex_key_t* head = key;      
-      key = head->next;
-      free(head);
+      struct bibtex_map_slot_t* old = map->slots;
+      size_t old_cap = map->cap;
+      size_t j;
+      map->cap *= 2;
+      map->slots = bibtex_map_slots(map);
+      for (j = 0; j < old_cap; j++)
+	{
+	  if (old[j].entry == NULL) continue;
+	  size_t k = old[j].hash & (map->cap - 1);
+	  while(map->slots[k].entry != NULL) k = (k + 1) & (map->cap - 1);
+	  map->slots[k] = old[j];
+	}
+      bibtex_free(map->allocator, old);
     }
+  size_t i = hash & (map->cap - 1);
+  while(map->slots[i].entry != NULL) i = (i + 1) & (map->cap - 1);
+  map->slots[i].hash = hash;
+  map->slots[i].key = map->key_of(entry);
+  map->slots[i].entry = entry;
+  map->len++;
+}
+
+static int bibtex_key_is_declared(struct biblexer_t* lex, struct bibtex_map_t* keys, const char* key, size_t hash)
+{
+  (void)lex;
+  bibtex_stats_begin(lex->stats, start);
+  int declared = bibtex_map_find(keys, key, hash) != NULL;
+  bibtex_stats_end(lex->stats, start, BIBTEX_STATS_PHASE_DUPLICATES);
+  return declared;
 }
 
 struct bibtex_field_id_t {
@@ -427,40 +830,50 @@ struct bibtex_field_id_t {
     struct bibtex_field_id_t* next;
 };
 
-static int bibtex_field_is_declared(struct bibtex_field_id_t* fields, enum bibtex_field_type_t field)
+static int bibtex_field_is_declared(struct biblexer_t* lex, struct bibtex_field_id_t* fields, enum bibtex_field_type_t field)
 {
+  int declared = 0;
+  (void)lex;
+  bibtex_stats_begin(lex->stats, start);
   while(fields != NULL)
     {
-      if (fields->type == field) return 1;
+      bibtex_stats_add(lex->stats, duplicate_probes, 1);
+      if (fields->type == field) {
+	declared = 1;
+	break;
+      }
       fields = fields->next;
     }
-  return 0;
+  bibtex_stats_end(lex->stats, start, BIBTEX_STATS_PHASE_DUPLICATES);
+  return declared;
 }
 
-static void bibtex_field_id_free(struct bibtex_field_id_t* field)
+static void bibtex_field_id_free(struct biblexer_t* lex, struct bibtex_field_id_t* field)
 {
   while(field != NULL)
     {
       struct bibtex_field_id_t* head = field;
       field = head->next;
-      free(head);
+      biblexer_free(lex, head);
     }
 }
 
 // TODO: support { } values
-struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* input)
+static struct bibtex_error_t bibtex_parse_lexer(struct bibtex_entry_t** root, struct biblexer_t* lex)
 {
-  struct biblexer_t lex = biblexer_init(input);
-  struct bibtex_error_t error = lex.error;
+  struct bibtex_error_t error = lex->error;
   struct bibtex_entry_t* head_entry = NULL;
   struct bibtex_entry_t* entry = NULL;
+  struct bibtex_entry_t* prev_entry = NULL;
+  size_t key_hash = 0;
+  int key_row = 0, key_col = 0;
   struct bibtex_field_t* head_field = NULL;
   struct bibtex_field_t* field = NULL;
-  struct bibtex_key_t* head_keys = NULL;
-  struct bibtex_key_t* keys = NULL;
+  struct bibtex_map_t keys;
   struct bibtex_field_id_t* head_fields = NULL;
   struct bibtex_field_id_t* fields = NULL;
-  struct bibtoken_t token = biblexer_next_token(&lex);
+  bibtex_map_init(&keys, bibtex_entry_citekey, 0, lex->allocator);
+  struct bibtoken_t token = biblexer_next_token(lex);
   struct bibtoken_t prev_token = token;
   if (token.type != BIBTOKEN_TYPE_AT)
     {
@@ -477,8 +890,8 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	{
 	case BIBTOKEN_TYPE_AT:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_break(token.type, error, lex->error);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
@@ -492,38 +905,41 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	  break;
 	case BIBTOKEN_TYPE_ID:
 	  struct bibtoken_t curr_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_free_break(lex, token.type, error, lex->error, curr_token.value);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
-	      free(curr_token.value);
+	      biblexer_free(lex, curr_token.value);
 	      goto clean_up;
 	    }
 	  if (prev_token.type == BIBTOKEN_TYPE_AT)
 	    {
+	      bibtex_stats_begin(lex->stats, classify_start);
 	      enum bibtex_entry_type_t entry_type = bibtex_entry_type_check(curr_token.value);
+	      bibtex_stats_end(lex->stats, classify_start, BIBTEX_STATS_PHASE_CLASSIFY);
 	      if (entry_type == -1) {
 		bibtex_error_init(&error, BIBTEX_ERROR_INVALID_ENTRY_TYPE, curr_token.row, curr_token.col);
-		free(curr_token.value);
+		biblexer_free(lex, curr_token.value);
 		goto clean_up;
 	      }
 	      if (token.type != BIBTOKEN_TYPE_LBRACE)
 		{
 		  bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_LBRACE,token.row, token.col);
-		  free(curr_token.value);
+		  biblexer_free(lex, curr_token.value);
 		  goto clean_up;
 		}
+	      prev_entry = entry;
 	      if (head_entry == NULL) {
-		head_entry = bibtex_entry_init(entry_type, NULL);
+		head_entry = bibtex_entry_init(lex, entry_type, NULL);
 		entry = head_entry;
 	      } else {
-		entry->next = bibtex_entry_init(entry_type, NULL);
+		entry->next = bibtex_entry_init(lex, entry_type, NULL);
 		entry = entry->next;
 	      }
 	      head_field = NULL;
-	      free(curr_token.value);
-	      bibtex_field_id_free(head_fields);
+	      biblexer_free(lex, curr_token.value);
+	      bibtex_field_id_free(lex, head_fields);
 	      head_fields = NULL;
 	    }
 	  else if (prev_token.type == BIBTOKEN_TYPE_LBRACE)
@@ -531,73 +947,75 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	      if (token.type != BIBTOKEN_TYPE_COMMA)
 		{
 		  bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_COMMA,token.row, token.col);
+		  biblexer_free(lex, curr_token.value);
+		  goto clean_up;
+		}
+	      size_t hash = bibtex_hash_value(curr_token.value);
+	      // With a query the key is checked and indexed once the entry is known to be kept.
+	      key_hash = hash;
+	      key_row = curr_token.row;
+	      key_col = curr_token.col;
+	      if (lex->query == NULL && bibtex_key_is_declared(lex, &keys, curr_token.value, hash))
+		{
+		  bibtex_error_init(&error, BIBTEX_ERROR_DUPLICATE_CITEKEY,curr_token.row, curr_token.col);
+		  biblexer_free(lex, curr_token.value);
 		  goto clean_up;
 		}
-	      if (head_keys == NULL) {
-	        head_keys = malloc(sizeof(struct bibtex_key_t));
-		keys = head_keys;
-		keys->key = curr_token.value;
-	      } else {
-		if (bibtex_key_is_declared(keys, curr_token.value))
-		  {
-		    bibtex_error_init(&error, BIBTEX_ERROR_DUPLICATE_CITEKEY,curr_token.row, curr_token.col);
-		    free(curr_token.value);
-		    goto clean_up;
-		  }
-		keys->next = malloc(sizeof(struct bibtex_key_t));
-		keys = keys->next;
-		keys->key = curr_token.value;
-	      }
 	      entry->key = curr_token.value;
+	      if (lex->query == NULL) bibtex_map_insert(&keys, entry, hash);
 	    }
 	  else if (prev_token.type == BIBTOKEN_TYPE_COMMA)
 	    {
+	      bibtex_stats_begin(lex->stats, classify_start);
 	      enum bibtex_field_type_t field_type = bibtex_field_type_check(curr_token.value);
+	      bibtex_stats_end(lex->stats, classify_start, BIBTEX_STATS_PHASE_CLASSIFY);
 	      if (field_type == -1) {
 		bibtex_error_init(&error, BIBTEX_ERROR_INVALID_FIELD_TYPE, curr_token.row, curr_token.col);
-		free(curr_token.value);
+		biblexer_free(lex, curr_token.value);
 	        goto clean_up;
 	      }
 	      if (token.type != BIBTOKEN_TYPE_EQ)
 		{
 		  bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_EQ,token.row, token.col);
-		  free(curr_token.value);
+		  biblexer_free(lex, curr_token.value);
 		  goto clean_up;
 		}
 	      if (head_field == NULL) {
-		head_field = bibtex_field_init(field_type, NULL);
+		head_field = bibtex_field_init(lex, field_type, NULL);
 		field = head_field;
 		entry->fields = field;
-		head_fields = malloc(sizeof(struct bibtex_field_id_t));
+		head_fields = biblexer_malloc(lex, sizeof(struct bibtex_field_id_t));
 		fields = head_fields;
 		fields->type = field_type;
+		fields->next = NULL;
 	      } else {
-		if (bibtex_field_is_declared(fields, field_type))
+		if (bibtex_field_is_declared(lex, fields, field_type))
 		  {
 		    bibtex_error_init(&error, BIBTEX_ERROR_DUPLICATE_FIELD,curr_token.row, curr_token.col);
-		    free(curr_token.value);
+		    biblexer_free(lex, curr_token.value);
 		    goto clean_up;
 		  }
-		field->next = bibtex_field_init(field_type, NULL);
+		field->next = bibtex_field_init(lex, field_type, NULL);
 		field = field->next;
-		fields->next = malloc(sizeof(struct bibtex_field_id_t));
+		fields->next = biblexer_malloc(lex, sizeof(struct bibtex_field_id_t));
 		fields = fields->next;
 	        fields->type = field_type;
+		fields->next = NULL;
 	      }
-	      free(curr_token.value);
+	      biblexer_free(lex, curr_token.value);
 	    }
 	  else
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_AT, curr_token.row, curr_token.col);
-	      free(curr_token.value);
+	      biblexer_free(lex, curr_token.value);
 	      goto clean_up;
 	    }
 	  prev_token = curr_token;
 	  break;
 	case BIBTOKEN_TYPE_EQ:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_break(token.type, error, lex->error);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
@@ -611,8 +1029,8 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	  break;
 	case BIBTOKEN_TYPE_LBRACE:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_break(token.type, error, lex->error);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
@@ -625,9 +1043,25 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	    }
 	  break;
 	case BIBTOKEN_TYPE_RBRACE:
+	  if (lex->query != NULL && !bibtex_query_match(lex->query, entry))
+	    {
+	      if (prev_entry == NULL) head_entry = NULL;
+	      else prev_entry->next = NULL;
+	      bibtex_entry_free_with(entry, lex->allocator);
+	      entry = prev_entry;
+	    }
+	  else if (lex->query != NULL && entry->key != NULL)
+	    {
+	      if (bibtex_key_is_declared(lex, &keys, entry->key, key_hash))
+		{
+		  bibtex_error_init(&error, BIBTEX_ERROR_DUPLICATE_CITEKEY, key_row, key_col);
+		  goto clean_up;
+		}
+	      bibtex_map_insert(&keys, entry, key_hash);
+	    }
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_break(token.type, error, lex->error);
 	  if (token.type != BIBTOKEN_TYPE_EOF && token.type != BIBTOKEN_TYPE_AT)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_AT,token.row, token.col);
@@ -636,8 +1070,8 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	  break;
 	case BIBTOKEN_TYPE_COMMA:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_break(token.type, error, lex->error);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
@@ -651,36 +1085,36 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	  break;
 	case BIBTOKEN_TYPE_STRING:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_free_break(lex, token.type, error, lex->error, prev_token.value);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
-	      free(prev_token.value);
+	      biblexer_free(lex, prev_token.value);
 	      goto clean_up;
 	    }
 	  if (token.type != BIBTOKEN_TYPE_COMMA && token.type != BIBTOKEN_TYPE_RBRACE)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_COMMA | BIBTEX_ERROR_EXPECT_RBRACE, token.row, token.col);
-	      free(prev_token.value);
+	      biblexer_free(lex, prev_token.value);
 	      goto clean_up;
 	    }
 	  field->value = prev_token.value;
 	  break;
 	case BIBTOKEN_TYPE_NUMBER:
 	  prev_token = token;
-	  token = biblexer_next_token(&lex);
-	  bibtex_if_token_error_break(token.type, error, lex.error);
+	  token = biblexer_next_token(lex);
+	  bibtex_if_token_error_free_break(lex, token.type, error, lex->error, prev_token.value);
 	  if (token.type == BIBTOKEN_TYPE_EOF)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_UNEXPECTED_END,token.row, token.col);
-	      free(prev_token.value);
+	      biblexer_free(lex, prev_token.value);
 	      goto clean_up;
 	    }
 	  if (token.type != BIBTOKEN_TYPE_COMMA && token.type != BIBTOKEN_TYPE_RBRACE)
 	    {
 	      bibtex_error_init(&error, BIBTEX_ERROR_EXPECT_COMMA | BIBTEX_ERROR_EXPECT_RBRACE, token.row, token.col);
-	      free(prev_token.value);
+	      biblexer_free(lex, prev_token.value);
 	      goto clean_up;
 	    }
 	  field->value = prev_token.value;
@@ -692,41 +1126,1731 @@ struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* inp
 	case BIBTOKEN_TYPE_ERROR: break;
 	}
     }
-  bibtex_field_id_free(head_fields);
-  bibtex_key_free(head_keys);
+  bibtex_field_id_free(lex, head_fields);
+  bibtex_stats_add(lex->stats, duplicate_probes, keys.probes);
+  bibtex_stats_add(lex->stats, allocations, keys.allocations);
+  bibtex_stats_add(lex->stats, bytes_allocated, keys.bytes_allocated);
+  bibtex_map_free(&keys);
+  biblexer_free(lex, token.value);
   *root = head_entry;
   return error;
  clean_up:
-  bibtex_field_id_free(head_fields);
-  bibtex_key_free(head_keys);
-  bibtex_entry_free(entry);
+  bibtex_field_id_free(lex, head_fields);
+  bibtex_stats_add(lex->stats, duplicate_probes, keys.probes);
+  bibtex_stats_add(lex->stats, allocations, keys.allocations);
+  bibtex_stats_add(lex->stats, bytes_allocated, keys.bytes_allocated);
+  bibtex_map_free(&keys);
+  biblexer_free(lex, token.value);
+  bibtex_entry_free_with(head_entry, lex->allocator);
   *root = NULL;
   return error;
 }
 
+struct bibtex_error_t bibtex_parse(struct bibtex_entry_t** root, const char* input)
+{
+  return bibtex_parse_with(root, input, NULL);
+}
+
+struct bibtex_error_t bibtex_parse_with(struct bibtex_entry_t** root, const char* input, const struct bibtex_allocator_t* allocator)
+{
+  struct biblexer_t lex = biblexer_init(input, allocator);
+  return bibtex_parse_lexer(root, &lex);
+}
+
+struct bibtex_error_t bibtex_parse_query(struct bibtex_entry_t** root, const char* input, const struct bibtex_query_t* query, const struct bibtex_allocator_t* allocator)
+{
+  struct biblexer_t lex = biblexer_init(input, allocator);
+  lex.query = query;
+  return bibtex_parse_lexer(root, &lex);
+}
+
+#ifdef BIBTEX_STATS
+struct bibtex_error_t bibtex_parse_stats(struct bibtex_entry_t** root, const char* input, const struct bibtex_allocator_t* allocator, struct bibtex_stats_t* stats)
+{
+  struct biblexer_t lex = biblexer_init(input, allocator);
+  memset(stats, 0, sizeof(struct bibtex_stats_t));
+  lex.stats = stats;
+  double start = BIBTEX_STATS_NOW();
+  struct bibtex_error_t error = bibtex_parse_lexer(root, &lex);
+  stats->seconds[BIBTEX_STATS_PHASE_TOTAL] = BIBTEX_STATS_NOW() - start;
+  stats->bytes_scanned = lex.pos;
+  return error;
+}
+
+const char* bibtex_stats_token_to_string(int type)
+{
+  switch(type)
+    {
+    case BIBTOKEN_TYPE_EOF:
+      return "eof";
+    case BIBTOKEN_TYPE_ID:
+      return "id";
+    case BIBTOKEN_TYPE_AT:
+      return "at";
+    case BIBTOKEN_TYPE_LBRACE:
+      return "lbrace";
+    case BIBTOKEN_TYPE_RBRACE:
+      return "rbrace";
+    case BIBTOKEN_TYPE_EQ:
+      return "eq";
+    case BIBTOKEN_TYPE_COMMA:
+      return "comma";
+    case BIBTOKEN_TYPE_STRING:
+      return "string";
+    case BIBTOKEN_TYPE_NUMBER:
+      return "number";
+    case BIBTOKEN_TYPE_INVALID:
+      return "invalid";
+    case BIBTOKEN_TYPE_ERROR:
+      return "error";
+    default:
+      return "Unknown token";
+    }
+}
+
+const char* bibtex_stats_phase_to_string(enum bibtex_stats_phase_t phase)
+{
+  switch(phase)
+    {
+    case BIBTEX_STATS_PHASE_LEX:
+      return "lex";
+    case BIBTEX_STATS_PHASE_CLASSIFY:
+      return "classify";
+    case BIBTEX_STATS_PHASE_DUPLICATES:
+      return "duplicates";
+    case BIBTEX_STATS_PHASE_BUILD:
+      return "build";
+    case BIBTEX_STATS_PHASE_TOTAL:
+      return "total";
+    default:
+      return "Unknown phase";
+    }
+}
+#endif
+
 void bibtex_field_free(struct bibtex_field_t* field)
+{
+  bibtex_field_free_with(field, NULL);
+}
+
+void bibtex_field_free_with(struct bibtex_field_t* field, const struct bibtex_allocator_t* allocator)
 {
   while(field != NULL)
     {
       struct bibtex_field_t* head = field;
-      free(head->value);      
+      if (head->utf8 != head->value) bibtex_free(allocator, head->utf8);
+      bibtex_free(allocator, head->names);
+      bibtex_free(allocator, head->value);
       field = head->next;
-      free(head);
+      bibtex_free(allocator, head);
     }
-  free(field);
 }
 
 void bibtex_entry_free(struct bibtex_entry_t* entry)
+{
+  bibtex_entry_free_with(entry, NULL);
+}
+
+void bibtex_entry_free_with(struct bibtex_entry_t* entry, const struct bibtex_allocator_t* allocator)
 {
   while(entry != NULL)
     {
       struct bibtex_entry_t* head = entry;
-      free(head->key);
-      bibtex_field_free(head->fields);
+      bibtex_free(allocator, head->key);
+      bibtex_field_free_with(head->fields, allocator);
       entry = head->next;
-      free(head);
+      bibtex_free(allocator, head);
+    }
+}
+
+static void bibtex_merge_index(struct bibtex_map_t* map, struct bibtex_entry_t* entry)
+{
+  const char* key = map->key_of(entry);
+  if (key == NULL) return;
+  size_t hash = bibtex_hash_value(key);
+  if (bibtex_map_find(map, key, hash) != entry) bibtex_map_insert(map, entry, hash);
+}
+
+static void bibtex_merge_entry(struct bibtex_entry_t* kept, struct bibtex_entry_t* dup, enum bibtex_merge_policy_t policy)
+{
+  if (policy == BIBTEX_MERGE_KEEP_LAST)
+    {
+      enum bibtex_entry_type_t type = kept->type;
+      char* key = kept->key;
+      struct bibtex_field_t* fields = kept->fields;
+      struct bibtex_entry_t* parent = kept->parent;
+      kept->type = dup->type;
+      kept->key = dup->key;
+      kept->fields = dup->fields;
+      kept->parent = dup->parent;
+      dup->type = type;
+      dup->key = key;
+      dup->fields = fields;
+      dup->parent = parent;
+    }
+  else if (policy == BIBTEX_MERGE_FIELDS)
+    {
+      unsigned long declared = 0;
+      struct bibtex_field_t** tail = &kept->fields;
+      while(*tail != NULL)
+	{
+	  declared |= 1UL << (*tail)->type;
+	  tail = &(*tail)->next;
+	}
+      struct bibtex_field_t** field = &dup->fields;
+      while(*field != NULL)
+	{
+	  struct bibtex_field_t* f = *field;
+	  if (declared & (1UL << f->type)) {
+	    field = &f->next;
+	    continue;
+	  }
+	  declared |= 1UL << f->type;
+	  *field = f->next;
+	  f->next = NULL;
+	  *tail = f;
+	  tail = &f->next;
+	}
+      if (kept->parent == NULL) kept->parent = dup->parent;
+    }
+}
+
+struct bibtex_merge_drop_t {
+    struct bibtex_entry_t* dup;
+    struct bibtex_entry_t* kept;
+};
+
+static int bibtex_merge_compare_drops(const void* a, const void* b)
+{
+  uintptr_t d0 = (uintptr_t)((const struct bibtex_merge_drop_t*)a)->dup;
+  uintptr_t d1 = (uintptr_t)((const struct bibtex_merge_drop_t*)b)->dup;
+  return (d0 > d1) - (d0 < d1);
+}
+
+size_t bibtex_merge(struct bibtex_entry_t** root, struct bibtex_entry_t** libraries, size_t count, enum bibtex_merge_policy_t policy, const struct bibtex_allocator_t* allocator)
+{
+  struct bibtex_map_t keys;
+  struct bibtex_map_t dois;
+  struct bibtex_entry_t* head = NULL;
+  struct bibtex_entry_t** tail = &head;
+  struct bibtex_merge_drop_t* drops = NULL;
+  size_t drops_cap = 0;
+  size_t total = 0;
+  size_t dropped = 0;
+  size_t i;
+  for (i = 0; i < count; i++)
+    {
+      struct bibtex_entry_t* e;
+      for (e = libraries[i]; e != NULL; e = e->next) total++;
+    }
+  bibtex_map_init(&keys, bibtex_entry_citekey, total, allocator);
+  bibtex_map_init(&dois, bibtex_entry_doi, total, allocator);
+  for (i = 0; i < count; i++)
+    {
+      struct bibtex_entry_t* entry = libraries[i];
+      libraries[i] = NULL;
+      while(entry != NULL)
+	{
+	  struct bibtex_entry_t* next = entry->next;
+	  struct bibtex_entry_t* kept = NULL;
+	  const char* doi = bibtex_entry_doi(entry);
+	  entry->next = NULL;
+	  if (entry->key != NULL) kept = bibtex_map_find(&keys, entry->key, bibtex_hash_value(entry->key));
+	  if (kept == NULL && doi != NULL) kept = bibtex_map_find(&dois, doi, bibtex_hash_value(doi));
+	  if (kept == NULL) {
+	    *tail = entry;
+	    tail = &entry->next;
+	    kept = entry;
+	  } else {
+	    bibtex_merge_entry(kept, entry, policy);
+	    bibtex_grow(allocator, &drops, &drops_cap, dropped + 1, sizeof(struct bibtex_merge_drop_t));
+	    drops[dropped].dup = entry;
+	    drops[dropped].kept = kept;
+	    dropped++;
+	  }
+	  bibtex_merge_index(&keys, kept);
+	  bibtex_merge_index(&dois, kept);
+	  entry = next;
+	}
+    }
+  bibtex_map_free(&keys);
+  bibtex_map_free(&dois);
+
+  // Dropped entries may be crossref parents: free them only once nothing points at them.
+  if (dropped > 0)
+    {
+      struct bibtex_entry_t* e;
+      qsort(drops, dropped, sizeof(struct bibtex_merge_drop_t), bibtex_merge_compare_drops);
+      for (e = head; e != NULL; e = e->next)
+	{
+	  struct bibtex_merge_drop_t key;
+	  if (e->parent == NULL) continue;
+	  key.dup = e->parent;
+	  const struct bibtex_merge_drop_t* drop = bsearch(&key, drops, dropped, sizeof(struct bibtex_merge_drop_t), bibtex_merge_compare_drops);
+	  if (drop == NULL) continue;
+	  struct bibtex_entry_t* ancestor = drop->kept;
+	  while(ancestor != NULL && ancestor != e) ancestor = ancestor->parent;
+	  e->parent = ancestor == e ? NULL : drop->kept;
+	  if (e->parent != NULL) e->parent->crossrefs++;
+	}
+      for (i = 0; i < dropped; i++) bibtex_entry_free_with(drops[i].dup, allocator);
+    }
+  bibtex_free(allocator, drops);
+  *root = head;
+  return dropped;
+}
+
+struct bibtex_field_t* bibtex_entry_field(const struct bibtex_entry_t* entry, enum bibtex_field_type_t type)
+{
+  while(entry != NULL)
+    {
+      struct bibtex_field_t* field;
+      for (field = entry->fields; field != NULL; field = field->next)
+	if (field->type == type) return field;
+      if (type == BIBTEX_FIELD_TYPE_CROSSREF) break;
+      entry = entry->parent;
+    }
+  return NULL;
+}
+
+size_t bibtex_crossref_resolve(struct bibtex_entry_t** root, struct bibtex_entry_t** hidden, size_t min_crossrefs, const struct bibtex_allocator_t* allocator)
+{
+  struct bibtex_map_t keys;
+  struct bibtex_entry_t* e;
+  size_t count = 0;
+  size_t unresolved = 0;
+  // Entries hidden by an earlier call are parents too: put them back and decide again.
+  if (hidden != NULL && *hidden != NULL)
+    {
+      struct bibtex_entry_t** tail = root;
+      while(*tail != NULL) tail = &(*tail)->next;
+      *tail = *hidden;
+      *hidden = NULL;
+    }
+  for (e = *root; e != NULL; e = e->next)
+    {
+      e->parent = NULL;
+      e->crossrefs = 0;
+      count++;
+    }
+  bibtex_map_init(&keys, bibtex_entry_citekey, count, allocator);
+  for (e = *root; e != NULL; e = e->next)
+    if (e->key != NULL) bibtex_merge_index(&keys, e);
+  for (e = *root; e != NULL; e = e->next)
+    {
+      struct bibtex_field_t* crossref = bibtex_entry_field(e, BIBTEX_FIELD_TYPE_CROSSREF);
+      if (crossref == NULL || crossref->value == NULL) continue;
+      const char* key = crossref->value;
+      while(isspace((unsigned char)*key)) key++;
+      struct bibtex_entry_t* parent = bibtex_map_find(&keys, key, bibtex_hash_value(key));
+      struct bibtex_entry_t* ancestor = parent;
+      while(ancestor != NULL && ancestor != e) ancestor = ancestor->parent;
+      if (parent == NULL || ancestor == e) {
+	unresolved++;
+	continue;
+      }
+      e->parent = parent;
+      parent->crossrefs++;
+    }
+  bibtex_map_free(&keys);
+  if (hidden != NULL && min_crossrefs > 0)
+    {
+      // Like BibTeX's min-crossrefs, parents referenced fewer times are not listed on their own.
+      struct bibtex_entry_t** link = root;
+      struct bibtex_entry_t** tail = hidden;
+      while(*link != NULL)
+	{
+	  e = *link;
+	  if (e->crossrefs > 0 && e->crossrefs < min_crossrefs) {
+	    *link = e->next;
+	    e->next = NULL;
+	    *tail = e;
+	    tail = &e->next;
+	  } else link = &e->next;
+	}
+    }
+  return unresolved;
+}
+
+static const char bibtex_tex_accents[] = "`'^\"~=.uvHckr";
+
+static const unsigned short bibtex_tex_combining[] = {
+  0x0300, 0x0301, 0x0302, 0x0308, 0x0303, 0x0304, 0x0307, 0x0306, 0x030C, 0x030B, 0x0327, 0x0328, 0x030A
+};
+
+// Precomposed code points indexed by accent and base letter (A-Z, then a-z), 0 if there is none.
+static const unsigned short bibtex_tex_precomposed[][52] = {
+  { // \`
+    0x00C0, 0, 0, 0, 0x00C8, 0, 0, 0, 0x00CC, 0, 0, 0, 0,
+    0x01F8, 0x00D2, 0, 0, 0, 0, 0, 0x00D9, 0, 0x1E80, 0, 0x1EF2, 0,
+    0x00E0, 0, 0, 0, 0x00E8, 0, 0, 0, 0x00EC, 0, 0, 0, 0,
+    0x01F9, 0x00F2, 0, 0, 0, 0, 0, 0x00F9, 0, 0x1E81, 0, 0x1EF3, 0
+  },
+  { // \'
+    0x00C1, 0, 0x0106, 0, 0x00C9, 0, 0x01F4, 0, 0x00CD, 0, 0x1E30, 0x0139, 0x1E3E,
+    0x0143, 0x00D3, 0x1E54, 0, 0x0154, 0x015A, 0, 0x00DA, 0, 0x1E82, 0, 0x00DD, 0x0179,
+    0x00E1, 0, 0x0107, 0, 0x00E9, 0, 0x01F5, 0, 0x00ED, 0, 0x1E31, 0x013A, 0x1E3F,
+    0x0144, 0x00F3, 0x1E55, 0, 0x0155, 0x015B, 0, 0x00FA, 0, 0x1E83, 0, 0x00FD, 0x017A
+  },
+  { // \^
+    0x00C2, 0, 0x0108, 0, 0x00CA, 0, 0x011C, 0x0124, 0x00CE, 0x0134, 0, 0, 0,
+    0, 0x00D4, 0, 0, 0, 0x015C, 0, 0x00DB, 0, 0x0174, 0, 0x0176, 0x1E90,
+    0x00E2, 0, 0x0109, 0, 0x00EA, 0, 0x011D, 0x0125, 0x00EE, 0x0135, 0, 0, 0,
+    0, 0x00F4, 0, 0, 0, 0x015D, 0, 0x00FB, 0, 0x0175, 0, 0x0177, 0x1E91
+  },
+  { // \"
+    0x00C4, 0, 0, 0, 0x00CB, 0, 0, 0x1E26, 0x00CF, 0, 0, 0, 0,
+    0, 0x00D6, 0, 0, 0, 0, 0, 0x00DC, 0, 0x1E84, 0x1E8C, 0x0178, 0,
+    0x00E4, 0, 0, 0, 0x00EB, 0, 0, 0x1E27, 0x00EF, 0, 0, 0, 0,
+    0, 0x00F6, 0, 0, 0, 0, 0x1E97, 0x00FC, 0, 0x1E85, 0x1E8D, 0x00FF, 0
+  },
+  { // \~
+    0x00C3, 0, 0, 0, 0x1EBC, 0, 0, 0, 0x0128, 0, 0, 0, 0,
+    0x00D1, 0x00D5, 0, 0, 0, 0, 0, 0x0168, 0x1E7C, 0, 0, 0x1EF8, 0,
+    0x00E3, 0, 0, 0, 0x1EBD, 0, 0, 0, 0x0129, 0, 0, 0, 0,
+    0x00F1, 0x00F5, 0, 0, 0, 0, 0, 0x0169, 0x1E7D, 0, 0, 0x1EF9, 0
+  },
+  { // \=
+    0x0100, 0, 0, 0, 0x0112, 0, 0x1E20, 0, 0x012A, 0, 0, 0, 0,
+    0, 0x014C, 0, 0, 0, 0, 0, 0x016A, 0, 0, 0, 0x0232, 0,
+    0x0101, 0, 0, 0, 0x0113, 0, 0x1E21, 0, 0x012B, 0, 0, 0, 0,
+    0, 0x014D, 0, 0, 0, 0, 0, 0x016B, 0, 0, 0, 0x0233, 0
+  },
+  { // \.
+    0x0226, 0x1E02, 0x010A, 0x1E0A, 0x0116, 0x1E1E, 0x0120, 0x1E22, 0x0130, 0, 0, 0, 0x1E40,
+    0x1E44, 0x022E, 0x1E56, 0, 0x1E58, 0x1E60, 0x1E6A, 0, 0, 0x1E86, 0x1E8A, 0x1E8E, 0x017B,
+    0x0227, 0x1E03, 0x010B, 0x1E0B, 0x0117, 0x1E1F, 0x0121, 0x1E23, 0, 0, 0, 0, 0x1E41,
+    0x1E45, 0x022F, 0x1E57, 0, 0x1E59, 0x1E61, 0x1E6B, 0, 0, 0x1E87, 0x1E8B, 0x1E8F, 0x017C
+  },
+  { // \u
+    0x0102, 0, 0, 0, 0x0114, 0, 0x011E, 0, 0x012C, 0, 0, 0, 0,
+    0, 0x014E, 0, 0, 0, 0, 0, 0x016C, 0, 0, 0, 0, 0,
+    0x0103, 0, 0, 0, 0x0115, 0, 0x011F, 0, 0x012D, 0, 0, 0, 0,
+    0, 0x014F, 0, 0, 0, 0, 0, 0x016D, 0, 0, 0, 0, 0
+  },
+  { // \v
+    0x01CD, 0, 0x010C, 0x010E, 0x011A, 0, 0x01E6, 0x021E, 0x01CF, 0, 0x01E8, 0x013D, 0,
+    0x0147, 0x01D1, 0, 0, 0x0158, 0x0160, 0x0164, 0x01D3, 0, 0, 0, 0, 0x017D,
+    0x01CE, 0, 0x010D, 0x010F, 0x011B, 0, 0x01E7, 0x021F, 0x01D0, 0x01F0, 0x01E9, 0x013E, 0,
+    0x0148, 0x01D2, 0, 0, 0x0159, 0x0161, 0x0165, 0x01D4, 0, 0, 0, 0, 0x017E
+  },
+  { // \H
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0x0150, 0, 0, 0, 0, 0, 0x0170, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0x0151, 0, 0, 0, 0, 0, 0x0171, 0, 0, 0, 0, 0
+  },
+  { // \c
+    0, 0, 0x00C7, 0x1E10, 0x0228, 0, 0x0122, 0x1E28, 0, 0, 0x0136, 0x013B, 0,
+    0x0145, 0, 0, 0, 0x0156, 0x015E, 0x0162, 0, 0, 0, 0, 0, 0,
+    0, 0, 0x00E7, 0x1E11, 0x0229, 0, 0x0123, 0x1E29, 0, 0, 0x0137, 0x013C, 0,
+    0x0146, 0, 0, 0, 0x0157, 0x015F, 0x0163, 0, 0, 0, 0, 0, 0
+  },
+  { // \k
+    0x0104, 0, 0, 0, 0x0118, 0, 0, 0, 0x012E, 0, 0, 0, 0,
+    0, 0x01EA, 0, 0, 0, 0, 0, 0x0172, 0, 0, 0, 0, 0,
+    0x0105, 0, 0, 0, 0x0119, 0, 0, 0, 0x012F, 0, 0, 0, 0,
+    0, 0x01EB, 0, 0, 0, 0, 0, 0x0173, 0, 0, 0, 0, 0
+  },
+  { // \r
+    0x00C5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x016E, 0, 0, 0, 0, 0,
+    0x00E5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x016F, 0, 0x1E98, 0, 0x1E99, 0
+  },
+};
+
+static const char* const bibtex_tex_symbols[][2] = {
+  {"aa", "\xC3\xA5"}, {"AA", "\xC3\x85"}, {"ae", "\xC3\xA6"}, {"AE", "\xC3\x86"},
+  {"i", "\xC4\xB1"}, {"j", "\xC8\xB7"}, {"l", "\xC5\x82"}, {"L", "\xC5\x81"},
+  {"o", "\xC3\xB8"}, {"O", "\xC3\x98"}, {"oe", "\xC5\x93"}, {"OE", "\xC5\x92"},
+  {"ss", "\xC3\x9F"},
+};
+
+// Characters that can start a TeX construct, everything else is copied as is.
+static int bibtex_tex_is_special(const char* value)
+{
+  return *value == '\\' || *value == '{' || *value == '}' || *value == '~'
+    || (*value == '-' && value[1] == '-') || (*value == '`' && value[1] == '`') || (*value == '\'' && value[1] == '\'');
+}
+
+static char* bibtex_utf8_put(char* out, unsigned cp)
+{
+  if (cp < 0x80) *out++ = cp;
+  else if (cp < 0x800) {
+    *out++ = 0xC0 | (cp >> 6);
+    *out++ = 0x80 | (cp & 0x3F);
+  } else {
+    *out++ = 0xE0 | (cp >> 12);
+    *out++ = 0x80 | ((cp >> 6) & 0x3F);
+    *out++ = 0x80 | (cp & 0x3F);
+  }
+  return out;
+}
+
+static char* bibtex_tex_accent(char* out, int accent, const char** in)
+{
+  const char* p = *in;
+  while(*p == ' ' || *p == '{') p++;
+  char base = *p;
+  if (base == '\\' && (p[1] == 'i' || p[1] == 'j') && !isalpha((unsigned char)p[2])) base = *++p;
+  if (base == '\0' || base == '}') {
+    *in = p;
+    return bibtex_utf8_put(out, bibtex_tex_combining[accent]);
+  }
+  *in = p + 1;
+  if (isupper((unsigned char)base) || islower((unsigned char)base))
+    {
+      int letter = isupper((unsigned char)base) ? base - 'A' : base - 'a' + 26;
+      if (bibtex_tex_precomposed[accent][letter] != 0) return bibtex_utf8_put(out, bibtex_tex_precomposed[accent][letter]);
+    }
+  *out++ = base;
+  // A non-ASCII base is copied whole, the mark must follow its last continuation byte.
+  if ((unsigned char)base >= 0xC0)
+    while(((unsigned char)**in & 0xC0) == 0x80) *out++ = *(*in)++;
+  return bibtex_utf8_put(out, bibtex_tex_combining[accent]);
+}
+
+static char* bibtex_tex_command(char* out, const char** in)
+{
+  const char* p = *in + 1;
+  const char* accent = *p != '\0' ? strchr(bibtex_tex_accents, *p) : NULL;
+  if (accent != NULL && (!isalpha((unsigned char)*p) || !isalpha((unsigned char)p[1])))
+    {
+      *in = p + 1;
+      return bibtex_tex_accent(out, accent - bibtex_tex_accents, in);
+    }
+  if (!isalpha((unsigned char)*p))
+    {
+      *in = *p ? p + 1 : p;
+      if (*p == '\\' || *p == ' ') *out++ = ' ';
+      else if (*p) *out++ = *p;
+      return out;
+    }
+  const char* name = p;
+  while(isalpha((unsigned char)*p)) p++;
+  size_t len = p - name;
+  size_t i;
+  while(*p == ' ') p++;
+  *in = p;
+  for (i = 0; i < sizeof(bibtex_tex_symbols) / sizeof(bibtex_tex_symbols[0]); i++)
+    if (strlen(bibtex_tex_symbols[i][0]) == len && strncmp(bibtex_tex_symbols[i][0], name, len) == 0) {
+      strcpy(out, bibtex_tex_symbols[i][1]);
+      return out + strlen(bibtex_tex_symbols[i][1]);
+    }
+  return out;
+}
+
+const char* bibtex_field_utf8(struct bibtex_field_t* field, const struct bibtex_allocator_t* allocator)
+{
+  if (field->utf8 != NULL || field->value == NULL) return field->utf8;
+  const char* in = field->value;
+  // URLs and DOIs are verbatim: ~ and -- are part of the address.
+  if (field->type != BIBTEX_FIELD_TYPE_URL && field->type != BIBTEX_FIELD_TYPE_DOI)
+    while(*in && !bibtex_tex_is_special(in)) in++;
+  else in += strlen(in);
+  if (*in == '\0') {
+    field->utf8 = field->value;
+    return field->utf8;
+  }
+  size_t len = strlen(field->value);
+  char* utf8 = bibtex_malloc(allocator, len * 2 + 1);
+  char* out = utf8 + (in - field->value);
+  memcpy(utf8, field->value, in - field->value);
+  while(*in)
+    {
+      switch(*in)
+	{
+	case '\\':
+	  out = bibtex_tex_command(out, &in);
+	  break;
+	case '{':
+	case '}':
+	  in++;
+	  break;
+	case '~':
+	  out = bibtex_utf8_put(out, 0x00A0);
+	  in++;
+	  break;
+	case '-':
+	  if (in[1] == '-' && in[2] == '-') {
+	    out = bibtex_utf8_put(out, 0x2014);
+	    in += 3;
+	  } else if (in[1] == '-') {
+	    out = bibtex_utf8_put(out, 0x2013);
+	    in += 2;
+	  } else *out++ = *in++;
+	  break;
+	case '`':
+	case '\'':
+	  if (in[1] == *in) {
+	    out = bibtex_utf8_put(out, *in == '`' ? 0x201C : 0x201D);
+	    in += 2;
+	  } else *out++ = *in++;
+	  break;
+	default:
+	  *out++ = *in++;
+	}
+    }
+  *out = '\0';
+  field->utf8 = utf8;
+  return field->utf8;
+}
+
+// Start of the next " and " separating two names at brace depth 0, or end.
+static const char* bibtex_names_next(const char* value, const char* end)
+{
+  int depth = 0;
+  const char* p;
+  for (p = value; p < end; p++)
+    {
+      if (*p == '{') depth++;
+      else if (*p == '}' && depth > 0) depth--;
+      else if (depth == 0 && isspace((unsigned char)*p) && end - p > 4
+	       && tolower((unsigned char)p[1]) == 'a' && tolower((unsigned char)p[2]) == 'n' && tolower((unsigned char)p[3]) == 'd'
+	       && isspace((unsigned char)p[4]))
+	return p;
     }
-  free(entry);
+  return end;
+}
+
+// A word belongs to the von part if its first letter at brace depth 0 is lowercase.
+// {\"u}ber style special characters count by their letter, other braced groups as uppercase.
+static int bibtex_names_is_von(const char* word, const char* end)
+{
+  const char* p = word;
+  while(p < end)
+    {
+      if (*p == '{') {
+	if (p + 1 < end && p[1] == '\\') {
+	  const char* name = p + 2;
+	  p = name;
+	  while(p < end && isalpha((unsigned char)*p)) p++;
+	  // accents decide by the accented letter, special letters such as \ss or \AA by their name
+	  if (p == name || (p - name == 1 && strchr(bibtex_tex_accents, *name) != NULL)) {
+	    if (p == name) p++;
+	    while(p < end && !isalpha((unsigned char)*p)) p++;
+	  } else p = name;
+	  return p < end && islower((unsigned char)*p);
+	}
+	return 0;
+      }
+      if (isalpha((unsigned char)*p)) return islower((unsigned char)*p);
+      p++;
+    }
+  return 0;
+}
+
+static void bibtex_names_range(struct bibtex_range_t* range, const char* value, const char** words, size_t from, size_t to)
+{
+  if (from >= to) {
+    range->start = 0;
+    range->length = 0;
+    return;
+  }
+  range->start = words[from * 2] - value;
+  range->length = words[to * 2 - 1] - words[from * 2];
+}
+
+static void bibtex_names_split(struct bibtex_name_t* name, const char* value, const char* start, const char* end, const char** words)
+{
+  size_t parts[3] = {0, 0, 0};
+  size_t nparts = 0;
+  size_t n = 0;
+  int depth = 0;
+  const char* p = start;
+  memset(name, 0, sizeof(struct bibtex_name_t));
+  while(p < end)
+    {
+      while(p < end && (isspace((unsigned char)*p) || *p == '~')) p++;
+      if (p >= end) break;
+      if (*p == ',') {
+	if (nparts < 2) parts[nparts++] = n;
+	p++;
+	continue;
+      }
+      words[n * 2] = p;
+      while(p < end && (depth > 0 || (!isspace((unsigned char)*p) && *p != '~' && *p != ',')))
+	{
+	  if (*p == '{') depth++;
+	  else if (*p == '}' && depth > 0) depth--;
+	  p++;
+	}
+      words[n * 2 + 1] = p;
+      n++;
+    }
+  if (n == 0) return;
+  if (nparts == 0)
+    {
+      // First von Last
+      size_t i, von = n, von_end = n;
+      for (i = 0; i + 1 < n; i++)
+	if (bibtex_names_is_von(words[i * 2], words[i * 2 + 1])) {
+	  if (von == n) von = i;
+	  von_end = i + 1;
+	}
+      if (von == n) {
+	bibtex_names_range(&name->first, value, words, 0, n - 1);
+	bibtex_names_range(&name->last, value, words, n - 1, n);
+      } else {
+	bibtex_names_range(&name->first, value, words, 0, von);
+	bibtex_names_range(&name->von, value, words, von, von_end);
+	bibtex_names_range(&name->last, value, words, von_end, n);
+      }
+      return;
+    }
+  // von Last, First or von Last, Jr, First
+  size_t i, von_end = 0;
+  for (i = 0; i + 1 < parts[0]; i++)
+    if (bibtex_names_is_von(words[i * 2], words[i * 2 + 1])) von_end = i + 1;
+  bibtex_names_range(&name->von, value, words, 0, von_end);
+  bibtex_names_range(&name->last, value, words, von_end, parts[0]);
+  if (nparts == 1) bibtex_names_range(&name->first, value, words, parts[0], n);
+  else {
+    bibtex_names_range(&name->jr, value, words, parts[0], parts[1]);
+    bibtex_names_range(&name->first, value, words, parts[1], n);
+  }
+}
+
+const struct bibtex_name_list_t* bibtex_field_names(struct bibtex_field_t* field, const struct bibtex_allocator_t* allocator)
+{
+  if (field->names != NULL || field->value == NULL) return field->names;
+  const char* value = field->value;
+  const char* end = value + strlen(value);
+  const char* p;
+  size_t count = 0;
+  for (p = value; p < end; count++)
+    {
+      p = bibtex_names_next(p, end);
+      p = p < end ? p + 5 : end;
+    }
+  struct bibtex_name_list_t* list = bibtex_malloc(allocator, sizeof(struct bibtex_name_list_t) + count * sizeof(struct bibtex_name_t));
+  const char** words = bibtex_malloc(allocator, ((end - value) / 2 + 1) * 2 * sizeof(const char*));
+  list->count = count;
+  list->names = (struct bibtex_name_t*)(list + 1);
+  for (count = 0, p = value; p < end; count++)
+    {
+      const char* next = bibtex_names_next(p, end);
+      bibtex_names_split(&list->names[count], value, p, next, words);
+      p = next < end ? next + 5 : end;
+    }
+  bibtex_free(allocator, words);
+  field->names = list;
+  return list;
+}
+
+struct bibtex_posting_t {
+    const char* term;
+    uint32_t length;
+    uint32_t field;
+    uint32_t id;
+};
+
+struct bibtex_index_shard_t {
+    const struct bibtex_entry_t** entries;
+    size_t begin;
+    size_t end;
+    unsigned long fields;
+    const struct bibtex_allocator_t* allocator;
+    struct bibtex_posting_t* postings;
+    size_t len;
+    size_t cap;
+};
+
+static int bibtex_index_is_word(char c)
+{
+  return isalnum((unsigned char)c) || (unsigned char)c >= 0x80;
+}
+
+static int bibtex_index_compare_terms(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+  size_t len = a_len < b_len ? a_len : b_len;
+  size_t i;
+  for (i = 0; i < len; i++)
+    {
+      int diff = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+      if (diff != 0) return diff;
+    }
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+static int bibtex_index_compare_postings(const void* a, const void* b)
+{
+  const struct bibtex_posting_t* p0 = a;
+  const struct bibtex_posting_t* p1 = b;
+  int diff = bibtex_index_compare_terms(p0->term, p0->length, p1->term, p1->length);
+  if (diff != 0) return diff;
+  if (p0->field != p1->field) return p0->field < p1->field ? -1 : 1;
+  return (p0->id > p1->id) - (p0->id < p1->id);
+}
+
+static int bibtex_index_compare_ids(const void* a, const void* b)
+{
+  size_t id0 = *(const size_t*)a;
+  size_t id1 = *(const size_t*)b;
+  return (id0 > id1) - (id0 < id1);
+}
+
+static void* bibtex_index_shard_build(void* arg)
+{
+  struct bibtex_index_shard_t* shard = arg;
+  size_t id;
+  for (id = shard->begin; id < shard->end; id++)
+    {
+      const struct bibtex_field_t* field;
+      for (field = shard->entries[id]->fields; field != NULL; field = field->next)
+	{
+	  const char* value = field->value;
+	  if (value == NULL || !(shard->fields & BIBTEX_FIELD_MASK(field->type))) continue;
+	  while(*value)
+	    {
+	      while(*value && !bibtex_index_is_word(*value)) value++;
+	      const char* start = value;
+	      while(bibtex_index_is_word(*value)) value++;
+	      if (value == start) continue;
+	      bibtex_grow(shard->allocator, &shard->postings, &shard->cap, shard->len + 1, sizeof(struct bibtex_posting_t));
+	      shard->postings[shard->len].term = start;
+	      shard->postings[shard->len].length = value - start;
+	      shard->postings[shard->len].field = field->type;
+	      shard->postings[shard->len].id = id;
+	      shard->len++;
+	    }
+	}
+    }
+  if (shard->len > 0) qsort(shard->postings, shard->len, sizeof(struct bibtex_posting_t), bibtex_index_compare_postings);
+  return NULL;
+}
+
+static void bibtex_index_put_varint(struct bibtex_index_t* index, size_t* cap, size_t value)
+{
+  bibtex_grow(index->allocator, &index->postings, cap, index->postings_len + 10, 1);
+  while(value >= 0x80)
+    {
+      index->postings[index->postings_len++] = (unsigned char)(value | 0x80);
+      value >>= 7;
+    }
+  index->postings[index->postings_len++] = (unsigned char)value;
+}
+
+static int bibtex_index_get_varint(const unsigned char** data, const unsigned char* end, size_t* value)
+{
+  int shift = 0;
+  *value = 0;
+  while(*data < end && shift < (int)(sizeof(size_t) * 8))
+    {
+      unsigned char byte = *(*data)++;
+      *value |= (size_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return 0;
+      shift += 7;
+    }
+  return -1;
+}
+
+int bibtex_index_build(struct bibtex_index_t* index, const struct bibtex_entry_t* root, unsigned long fields, int threads, const struct bibtex_allocator_t* allocator)
+{
+  const struct bibtex_entry_t* e;
+  size_t count = 0;
+  size_t terms_cap = 0, strings_cap = 0, postings_cap = 0;
+  size_t i;
+  memset(index, 0, sizeof(struct bibtex_index_t));
+  index->allocator = allocator;
+  for (e = root; e != NULL; e = e->next) count++;
+  if (count > UINT32_MAX) return -1;
+  index->entries = count;
+  const struct bibtex_entry_t** entries = bibtex_malloc(allocator, (count ? count : 1) * sizeof(struct bibtex_entry_t*));
+  for (i = 0, e = root; e != NULL; e = e->next) entries[i++] = e;
+
+#ifdef BIBTEX_THREADS
+  if (threads < 1) threads = 1;
+  if ((size_t)threads > count) threads = count ? (int)count : 1;
+#else
+  threads = 1;
+#endif
+  struct bibtex_index_shard_t* shards = bibtex_malloc(allocator, threads * sizeof(struct bibtex_index_shard_t));
+  size_t* heads = bibtex_malloc(allocator, threads * sizeof(size_t));
+  for (i = 0; i < (size_t)threads; i++)
+    {
+      memset(&shards[i], 0, sizeof(struct bibtex_index_shard_t));
+      shards[i].entries = entries;
+      shards[i].begin = count * i / threads;
+      shards[i].end = count * (i + 1) / threads;
+      shards[i].fields = fields;
+      shards[i].allocator = allocator;
+      heads[i] = 0;
+    }
+#ifdef BIBTEX_THREADS
+  pthread_t* workers = bibtex_malloc(allocator, threads * sizeof(pthread_t));
+  int* started = bibtex_malloc(allocator, threads * sizeof(int));
+  for (i = 1; i < (size_t)threads; i++)
+    started[i] = pthread_create(&workers[i], NULL, bibtex_index_shard_build, &shards[i]) == 0;
+  bibtex_index_shard_build(&shards[0]);
+  for (i = 1; i < (size_t)threads; i++)
+    {
+      if (started[i]) pthread_join(workers[i], NULL);
+      else bibtex_index_shard_build(&shards[i]);
+    }
+  bibtex_free(allocator, workers);
+  bibtex_free(allocator, started);
+#else
+  bibtex_index_shard_build(&shards[0]);
+#endif
+
+  // Shards cover increasing id ranges, so merging them in shard order keeps posting lists sorted.
+  const struct bibtex_posting_t* term = NULL;
+  const struct bibtex_posting_t* text = NULL;
+  size_t last_id = 0;
+  for (;;)
+    {
+      const struct bibtex_posting_t* p = NULL;
+      size_t shard = 0;
+      for (i = 0; i < (size_t)threads; i++)
+	{
+	  if (heads[i] >= shards[i].len) continue;
+	  const struct bibtex_posting_t* q = &shards[i].postings[heads[i]];
+	  if (p == NULL) {
+	    p = q;
+	    shard = i;
+	    continue;
+	  }
+	  int diff = bibtex_index_compare_terms(q->term, q->length, p->term, p->length);
+	  if (diff < 0 || (diff == 0 && q->field < p->field)) {
+	    p = q;
+	    shard = i;
+	  }
+	}
+      if (p == NULL) break;
+      heads[shard]++;
+      if (term == NULL || p->field != term->field || bibtex_index_compare_terms(p->term, p->length, term->term, term->length) != 0)
+	{
+	  bibtex_grow(allocator, &index->terms, &terms_cap, index->term_count + 1, sizeof(struct bibtex_index_term_t));
+	  struct bibtex_index_term_t* t = &index->terms[index->term_count++];
+	  if (text == NULL || bibtex_index_compare_terms(p->term, p->length, text->term, text->length) != 0)
+	    {
+	      bibtex_grow(allocator, &index->strings, &strings_cap, index->strings_len + p->length + 1, 1);
+	      for (i = 0; i < p->length; i++) index->strings[index->strings_len + i] = tolower((unsigned char)p->term[i]);
+	      index->strings[index->strings_len + p->length] = '\0';
+	      t->offset = index->strings_len;
+	      index->strings_len += p->length + 1;
+	      text = p;
+	    }
+	  else t->offset = t[-1].offset;
+	  t->length = p->length;
+	  t->field = p->field;
+	  t->count = 0;
+	  t->postings = index->postings_len;
+	  term = p;
+	}
+      struct bibtex_index_term_t* t = &index->terms[index->term_count - 1];
+      if (t->count > 0 && p->id == last_id) continue;
+      bibtex_index_put_varint(index, &postings_cap, t->count > 0 ? p->id - last_id : p->id);
+      t->count++;
+      last_id = p->id;
+    }
+
+  for (i = 0; i < (size_t)threads; i++) bibtex_free(allocator, shards[i].postings);
+  bibtex_free(allocator, shards);
+  bibtex_free(allocator, heads);
+  bibtex_free(allocator, entries);
+  return 0;
+}
+
+static size_t bibtex_index_lower_bound(const struct bibtex_index_t* index, const char* word, size_t len)
+{
+  size_t lo = 0, hi = index->term_count;
+  while(lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct bibtex_index_term_t* t = &index->terms[mid];
+      if (bibtex_index_compare_terms(index->strings + t->offset, t->length, word, len) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+  return lo;
+}
+
+static size_t bibtex_index_lookup(const struct bibtex_index_t* index, const char* word, size_t len, int prefix, unsigned long fields, size_t** ids, size_t* cap)
+{
+  size_t count = 0;
+  size_t lists = 0;
+  size_t i;
+  for (i = bibtex_index_lower_bound(index, word, len); i < index->term_count; i++)
+    {
+      const struct bibtex_index_term_t* t = &index->terms[i];
+      if (t->length < len || bibtex_index_compare_terms(index->strings + t->offset, len, word, len) != 0) break;
+      if (!prefix && t->length != len) break;
+      if (!(fields & BIBTEX_FIELD_MASK(t->field))) continue;
+      const unsigned char* data = index->postings + t->postings;
+      const unsigned char* end = index->postings + index->postings_len;
+      size_t id = 0, delta;
+      uint32_t j;
+      bibtex_grow(index->allocator, ids, cap, count + t->count, sizeof(size_t));
+      lists++;
+      for (j = 0; j < t->count && bibtex_index_get_varint(&data, end, &delta) == 0; j++)
+	{
+	  id += delta;
+	  (*ids)[count++] = id;
+	}
+    }
+  if (lists > 1)
+    {
+      size_t unique = 1;
+      qsort(*ids, count, sizeof(size_t), bibtex_index_compare_ids);
+      for (i = 1; i < count; i++)
+	if ((*ids)[i] != (*ids)[unique - 1]) (*ids)[unique++] = (*ids)[i];
+      count = unique;
+    }
+  return count;
+}
+
+size_t bibtex_index_search(const struct bibtex_index_t* index, const char* query, unsigned long fields, enum bibtex_index_mode_t mode, size_t** ids)
+{
+  size_t* result = NULL;
+  size_t result_len = 0, result_cap = 0;
+  size_t* word_ids = NULL;
+  size_t word_cap = 0;
+  size_t* merged = NULL;
+  size_t merged_cap = 0;
+  int first = 1;
+  while(*query)
+    {
+      while(*query && !bibtex_index_is_word(*query)) query++;
+      const char* word = query;
+      while(bibtex_index_is_word(*query)) query++;
+      size_t len = query - word;
+      if (len == 0) break;
+      int prefix = *query == '*';
+      size_t word_len = bibtex_index_lookup(index, word, len, prefix, fields, &word_ids, &word_cap);
+      if (first) {
+	bibtex_grow(index->allocator, &result, &result_cap, word_len, sizeof(size_t));
+	if (word_len > 0) memcpy(result, word_ids, word_len * sizeof(size_t));
+	result_len = word_len;
+	first = 0;
+      } else {
+	size_t i = 0, j = 0, n = 0;
+	bibtex_grow(index->allocator, &merged, &merged_cap, result_len + word_len, sizeof(size_t));
+	while(i < result_len && j < word_len)
+	  {
+	    if (result[i] == word_ids[j]) {
+	      merged[n++] = result[i++];
+	      j++;
+	    } else if (result[i] < word_ids[j]) {
+	      if (mode == BIBTEX_INDEX_OR) merged[n++] = result[i];
+	      i++;
+	    } else {
+	      if (mode == BIBTEX_INDEX_OR) merged[n++] = word_ids[j];
+	      j++;
+	    }
+	  }
+	if (mode == BIBTEX_INDEX_OR)
+	  {
+	    while(i < result_len) merged[n++] = result[i++];
+	    while(j < word_len) merged[n++] = word_ids[j++];
+	  }
+	size_t* tmp = result;
+	size_t tmp_cap = result_cap;
+	result = merged;
+	result_cap = merged_cap;
+	merged = tmp;
+	merged_cap = tmp_cap;
+	result_len = n;
+      }
+      if (mode == BIBTEX_INDEX_AND && result_len == 0) break;
+    }
+  bibtex_free(index->allocator, word_ids);
+  bibtex_free(index->allocator, merged);
+  if (result_len == 0) {
+    bibtex_free(index->allocator, result);
+    result = NULL;
+  }
+  *ids = result;
+  return result_len;
+}
+
+void bibtex_index_results_free(const struct bibtex_index_t* index, size_t* ids)
+{
+  bibtex_free(index->allocator, ids);
+}
+
+struct bibtex_index_header_t {
+    char magic[8];
+    uint64_t entries;
+    uint64_t term_count;
+    uint64_t strings_len;
+    uint64_t postings_len;
+};
+
+static const char bibtex_index_magic[8] = "BIBIDX1";
+
+int bibtex_index_save(const struct bibtex_index_t* index, FILE* file)
+{
+  struct bibtex_index_header_t header;
+  memcpy(header.magic, bibtex_index_magic, sizeof(header.magic));
+  header.entries = index->entries;
+  header.term_count = index->term_count;
+  header.strings_len = index->strings_len;
+  header.postings_len = index->postings_len;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) return -1;
+  if (fwrite(index->terms, sizeof(struct bibtex_index_term_t), index->term_count, file) != index->term_count) return -1;
+  if (fwrite(index->strings, 1, index->strings_len, file) != index->strings_len) return -1;
+  if (fwrite(index->postings, 1, index->postings_len, file) != index->postings_len) return -1;
+  return 0;
+}
+
+int bibtex_index_load(struct bibtex_index_t* index, FILE* file, const struct bibtex_allocator_t* allocator)
+{
+  struct bibtex_index_header_t header;
+  uint64_t remaining = UINT64_MAX;
+  long pos;
+  memset(index, 0, sizeof(struct bibtex_index_t));
+  index->allocator = allocator;
+  if (fread(&header, sizeof(header), 1, file) != 1) return -1;
+  if (memcmp(header.magic, bibtex_index_magic, sizeof(header.magic)) != 0) return -1;
+  if (header.entries > UINT32_MAX || header.term_count > SIZE_MAX / sizeof(struct bibtex_index_term_t)
+      || header.strings_len > SIZE_MAX || header.postings_len > SIZE_MAX)
+    return -1;
+  // Sizes must fit in the rest of the file before anything is allocated for them;
+  // streams that cannot seek still fail on a short fread.
+  pos = ftell(file);
+  if (pos >= 0 && fseek(file, 0, SEEK_END) == 0) {
+    long end = ftell(file);
+    if (end < pos || fseek(file, pos, SEEK_SET) != 0) return -1;
+    remaining = (uint64_t)(end - pos);
+  }
+  if (header.term_count > remaining / sizeof(struct bibtex_index_term_t)) return -1;
+  remaining -= header.term_count * sizeof(struct bibtex_index_term_t);
+  if (header.strings_len > remaining) return -1;
+  remaining -= header.strings_len;
+  if (header.postings_len > remaining) return -1;
+  index->entries = header.entries;
+  index->term_count = header.term_count;
+  index->strings_len = header.strings_len;
+  index->postings_len = header.postings_len;
+  index->terms = bibtex_malloc(allocator, (index->term_count ? index->term_count : 1) * sizeof(struct bibtex_index_term_t));
+  index->strings = bibtex_malloc(allocator, index->strings_len ? index->strings_len : 1);
+  index->postings = bibtex_malloc(allocator, index->postings_len ? index->postings_len : 1);
+  if (index->terms == NULL || index->strings == NULL || index->postings == NULL
+      || fread(index->terms, sizeof(struct bibtex_index_term_t), index->term_count, file) != index->term_count
+      || fread(index->strings, 1, index->strings_len, file) != index->strings_len
+      || fread(index->postings, 1, index->postings_len, file) != index->postings_len)
+    {
+      bibtex_index_free(index);
+      return -1;
+    }
+  // The file is not trusted: check every term and decode every posting list before searching them.
+  size_t i;
+  for (i = 0; i < index->term_count; i++)
+    {
+      const struct bibtex_index_term_t* t = &index->terms[i];
+      const struct bibtex_index_term_t* prev = i > 0 ? &index->terms[i - 1] : NULL;
+      const unsigned char* data;
+      const unsigned char* end = index->postings + index->postings_len;
+      size_t id = 0, delta;
+      uint32_t j;
+      int valid = (uint64_t)t->offset + t->length < index->strings_len && index->strings[t->offset + t->length] == '\0'
+	&& t->field <= BIBTEX_FIELD_TYPE_CROSSREF && t->postings <= index->postings_len && t->count > 0;
+      if (valid && prev != NULL) {
+	int diff = bibtex_index_compare_terms(index->strings + prev->offset, prev->length, index->strings + t->offset, t->length);
+	valid = diff < 0 || (diff == 0 && prev->field < t->field);
+      }
+      data = valid ? index->postings + t->postings : end;
+      for (j = 0; valid && j < t->count; j++)
+	{
+	  valid = bibtex_index_get_varint(&data, end, &delta) == 0 && (j == 0 || delta > 0)
+	    && delta < index->entries - id;
+	  id += delta;
+	}
+      if (!valid) {
+	bibtex_index_free(index);
+	return -1;
+      }
+    }
+  return 0;
+}
+
+void bibtex_index_free(struct bibtex_index_t* index)
+{
+  bibtex_free(index->allocator, index->terms);
+  bibtex_free(index->allocator, index->strings);
+  bibtex_free(index->allocator, index->postings);
+  index->terms = NULL;
+  index->strings = NULL;
+  index->postings = NULL;
+  index->term_count = 0;
+  index->strings_len = 0;
+  index->postings_len = 0;
+}
+
+// Queries compile to a flat program over a single result register: every test overwrites it,
+// and/or jump over their right operand, so evaluation short-circuits without a stack.
+enum bibtex_query_opcode_t
+{
+  BIBTEX_QUERY_OP_TYPE,
+  BIBTEX_QUERY_OP_HAS,
+  BIBTEX_QUERY_OP_NUMBER,
+  BIBTEX_QUERY_OP_EQUAL,
+  BIBTEX_QUERY_OP_CONTAINS,
+  BIBTEX_QUERY_OP_NOT,
+  BIBTEX_QUERY_OP_JUMP_FALSE,
+  BIBTEX_QUERY_OP_JUMP_TRUE,
+};
+
+enum bibtex_query_token_t
+{
+  BIBTEX_QUERY_TOKEN_END,
+  BIBTEX_QUERY_TOKEN_ID,
+  BIBTEX_QUERY_TOKEN_NUMBER,
+  BIBTEX_QUERY_TOKEN_STRING,
+  BIBTEX_QUERY_TOKEN_LBRACE,
+  BIBTEX_QUERY_TOKEN_RBRACE,
+  BIBTEX_QUERY_TOKEN_COMMA,
+  BIBTEX_QUERY_TOKEN_LPAREN,
+  BIBTEX_QUERY_TOKEN_RPAREN,
+  BIBTEX_QUERY_TOKEN_AND,
+  BIBTEX_QUERY_TOKEN_OR,
+  BIBTEX_QUERY_TOKEN_NOT,
+  BIBTEX_QUERY_TOKEN_IN,
+  BIBTEX_QUERY_TOKEN_EQ,
+  BIBTEX_QUERY_TOKEN_NE,
+  BIBTEX_QUERY_TOKEN_LT,
+  BIBTEX_QUERY_TOKEN_LE,
+  BIBTEX_QUERY_TOKEN_GT,
+  BIBTEX_QUERY_TOKEN_GE,
+  BIBTEX_QUERY_TOKEN_CONTAINS,
+  BIBTEX_QUERY_TOKEN_INVALID,
+};
+
+// The citekey is addressed like one more field after the last field type.
+#define BIBTEX_QUERY_KEY (BIBTEX_FIELD_TYPE_CROSSREF + 1)
+#define BIBTEX_QUERY_SLOTS (BIBTEX_QUERY_KEY + 1)
+
+struct bibtex_query_op_t {
+    enum bibtex_query_opcode_t code;
+    enum bibtex_query_token_t cmp; // EQ..GE for NUMBER, EQ or NE for EQUAL
+    int field;
+    unsigned long mask;
+    long number;
+    size_t string; // offset into strings, lower case
+    size_t length;
+    size_t jump;
+};
+
+struct bibtex_query_t {
+    struct bibtex_query_op_t* ops;
+    size_t len;
+    size_t cap;
+    char* strings;
+    size_t strings_len;
+    size_t strings_cap;
+    unsigned long fields; // slots the program reads
+    const struct bibtex_allocator_t* allocator;
+};
+
+struct bibtex_query_parser_t {
+    struct bibtex_query_t* query;
+    const char* text;
+    const char* pos;
+    enum bibtex_query_token_t token;
+    const char* start;
+    size_t length;
+    struct bibtex_error_t error;
+};
+
+// What the program sees of one entry: values with crossref parents folded in, and
+// integers parsed on first use so year/volume/number are converted at most once.
+struct bibtex_query_row_t {
+    const struct bibtex_entry_t* entry;
+    unsigned long present;
+    unsigned long parsed;
+    unsigned long numeric;
+    const char* values[BIBTEX_QUERY_SLOTS];
+    long numbers[BIBTEX_QUERY_SLOTS];
+};
+
+struct bibtex_query_shard_t {
+    const struct bibtex_query_t* query;
+    const struct bibtex_entry_t** entries;
+    size_t begin;
+    size_t end;
+    unsigned char* hits;
+};
+
+static int bibtex_query_is_word(const struct bibtex_query_parser_t* p, const char* word)
+{
+  size_t len = strlen(word);
+  return p->length == len && bibtex_index_compare_terms(p->start, p->length, word, len) == 0;
+}
+
+static void bibtex_query_next(struct bibtex_query_parser_t* p)
+{
+  const char* s = p->pos;
+  while(isspace((unsigned char)*s)) s++;
+  p->start = s;
+  if (*s == '\0') p->token = BIBTEX_QUERY_TOKEN_END;
+  else if (isalpha((unsigned char)*s) || *s == '_')
+    {
+      while(isalnum((unsigned char)*s) || *s == '_') s++;
+      p->length = s - p->start;
+      p->token = BIBTEX_QUERY_TOKEN_ID;
+      if (bibtex_query_is_word(p, "and")) p->token = BIBTEX_QUERY_TOKEN_AND;
+      else if (bibtex_query_is_word(p, "or")) p->token = BIBTEX_QUERY_TOKEN_OR;
+      else if (bibtex_query_is_word(p, "not")) p->token = BIBTEX_QUERY_TOKEN_NOT;
+      else if (bibtex_query_is_word(p, "in")) p->token = BIBTEX_QUERY_TOKEN_IN;
+    }
+  else if (isdigit((unsigned char)*s) || (*s == '-' && isdigit((unsigned char)s[1])))
+    {
+      s++;
+      while(isdigit((unsigned char)*s)) s++;
+      p->token = BIBTEX_QUERY_TOKEN_NUMBER;
+    }
+  else if (*s == '"')
+    {
+      s++;
+      while(*s && *s != '"') s++;
+      if (*s == '"') {
+	s++;
+	p->token = BIBTEX_QUERY_TOKEN_STRING;
+      } else p->token = BIBTEX_QUERY_TOKEN_INVALID;
+    }
+  else
+    {
+      p->token = BIBTEX_QUERY_TOKEN_INVALID;
+      switch(*s++)
+	{
+	case '{': p->token = BIBTEX_QUERY_TOKEN_LBRACE; break;
+	case '}': p->token = BIBTEX_QUERY_TOKEN_RBRACE; break;
+	case ',': p->token = BIBTEX_QUERY_TOKEN_COMMA; break;
+	case '(': p->token = BIBTEX_QUERY_TOKEN_LPAREN; break;
+	case ')': p->token = BIBTEX_QUERY_TOKEN_RPAREN; break;
+	case '~': p->token = BIBTEX_QUERY_TOKEN_CONTAINS; break;
+	case '=':
+	  if (*s == '=') s++;
+	  p->token = BIBTEX_QUERY_TOKEN_EQ;
+	  break;
+	case '!':
+	  if (*s == '=') {
+	    s++;
+	    p->token = BIBTEX_QUERY_TOKEN_NE;
+	  } else p->token = BIBTEX_QUERY_TOKEN_NOT;
+	  break;
+	case '<':
+	  if (*s == '=') {
+	    s++;
+	    p->token = BIBTEX_QUERY_TOKEN_LE;
+	  } else p->token = BIBTEX_QUERY_TOKEN_LT;
+	  break;
+	case '>':
+	  if (*s == '=') {
+	    s++;
+	    p->token = BIBTEX_QUERY_TOKEN_GE;
+	  } else p->token = BIBTEX_QUERY_TOKEN_GT;
+	  break;
+	case '&':
+	  if (*s == '&') {
+	    s++;
+	    p->token = BIBTEX_QUERY_TOKEN_AND;
+	  }
+	  break;
+	case '|':
+	  if (*s == '|') {
+	    s++;
+	    p->token = BIBTEX_QUERY_TOKEN_OR;
+	  }
+	  break;
+	}
+    }
+  p->length = s - p->start;
+  p->pos = s;
+}
+
+static int bibtex_query_fail(struct bibtex_query_parser_t* p, const char* at)
+{
+  if (p->error.type == BIBTEX_OK) bibtex_error_init(&p->error, BIBTEX_ERROR_INVALID_QUERY, 1, at - p->text + 1);
+  return -1;
+}
+
+static size_t bibtex_query_emit(struct bibtex_query_t* query, enum bibtex_query_opcode_t code)
+{
+  bibtex_grow(query->allocator, &query->ops, &query->cap, query->len + 1, sizeof(struct bibtex_query_op_t));
+  memset(&query->ops[query->len], 0, sizeof(struct bibtex_query_op_t));
+  query->ops[query->len].code = code;
+  return query->len++;
+}
+
+// Copies the current id token into buf so the NUL terminated type lookups can be reused.
+static const char* bibtex_query_name(const struct bibtex_query_parser_t* p, char* buf, size_t size)
+{
+  if (p->length >= size) return "";
+  memcpy(buf, p->start, p->length);
+  buf[p->length] = '\0';
+  return buf;
+}
+
+static int bibtex_query_entry_types(struct bibtex_query_parser_t* p, unsigned long* mask)
+{
+  char buf[32];
+  if (p->token != BIBTEX_QUERY_TOKEN_ID) return bibtex_query_fail(p, p->start);
+  int type = bibtex_entry_type_check(bibtex_query_name(p, buf, sizeof(buf)));
+  if (type < 0) return bibtex_query_fail(p, p->start);
+  *mask |= 1UL << type;
+  bibtex_query_next(p);
+  return 0;
+}
+
+static int bibtex_query_predicate(struct bibtex_query_parser_t* p)
+{
+  struct bibtex_query_t* query = p->query;
+  const char* name = p->start;
+  char buf[32];
+  unsigned long mask = 0;
+  int field;
+  if (bibtex_query_is_word(p, "key")) field = BIBTEX_QUERY_KEY;
+  else field = bibtex_field_type_check(bibtex_query_name(p, buf, sizeof(buf)));
+  int is_type = bibtex_query_is_word(p, "type");
+  bibtex_query_next(p);
+
+  // "type" is the entry type before "in" or before ==/!= with a bare name, the type field otherwise.
+  if (is_type && p->token == BIBTEX_QUERY_TOKEN_IN)
+    {
+      bibtex_query_next(p);
+      if (p->token != BIBTEX_QUERY_TOKEN_LBRACE) return bibtex_query_fail(p, p->start);
+      do
+	{
+	  bibtex_query_next(p);
+	  if (bibtex_query_entry_types(p, &mask) != 0) return -1;
+	}
+      while(p->token == BIBTEX_QUERY_TOKEN_COMMA);
+      if (p->token != BIBTEX_QUERY_TOKEN_RBRACE) return bibtex_query_fail(p, p->start);
+      bibtex_query_next(p);
+      size_t op = bibtex_query_emit(query, BIBTEX_QUERY_OP_TYPE);
+      query->ops[op].mask = mask;
+      return 0;
+    }
+  if (is_type && (p->token == BIBTEX_QUERY_TOKEN_EQ || p->token == BIBTEX_QUERY_TOKEN_NE))
+    {
+      struct bibtex_query_parser_t peek = *p;
+      bibtex_query_next(&peek);
+      if (peek.token == BIBTEX_QUERY_TOKEN_ID)
+	{
+	  enum bibtex_query_token_t cmp = p->token;
+	  *p = peek;
+	  if (bibtex_query_entry_types(p, &mask) != 0) return -1;
+	  size_t op = bibtex_query_emit(query, BIBTEX_QUERY_OP_TYPE);
+	  query->ops[op].mask = mask;
+	  if (cmp == BIBTEX_QUERY_TOKEN_NE) bibtex_query_emit(query, BIBTEX_QUERY_OP_NOT);
+	  return 0;
+	}
+    }
+
+  if (field == -1) return bibtex_query_fail(p, name);
+  query->fields |= 1UL << field;
+  if (p->token < BIBTEX_QUERY_TOKEN_EQ || p->token > BIBTEX_QUERY_TOKEN_CONTAINS)
+    {
+      size_t op = bibtex_query_emit(query, BIBTEX_QUERY_OP_HAS);
+      query->ops[op].mask = 1UL << field;
+      return 0;
+    }
+
+  enum bibtex_query_token_t cmp = p->token;
+  bibtex_query_next(p);
+  if (p->token == BIBTEX_QUERY_TOKEN_NUMBER && cmp != BIBTEX_QUERY_TOKEN_CONTAINS)
+    {
+      size_t op = bibtex_query_emit(query, BIBTEX_QUERY_OP_NUMBER);
+      query->ops[op].field = field;
+      query->ops[op].cmp = cmp;
+      query->ops[op].number = strtol(p->start, NULL, 10);
+      bibtex_query_next(p);
+      return 0;
+    }
+  if (p->token != BIBTEX_QUERY_TOKEN_STRING && p->token != BIBTEX_QUERY_TOKEN_ID && p->token != BIBTEX_QUERY_TOKEN_NUMBER)
+    return bibtex_query_fail(p, p->start);
+  if (cmp != BIBTEX_QUERY_TOKEN_EQ && cmp != BIBTEX_QUERY_TOKEN_NE && cmp != BIBTEX_QUERY_TOKEN_CONTAINS)
+    return bibtex_query_fail(p, p->start);
+
+  const char* value = p->start;
+  size_t length = p->length;
+  size_t i;
+  if (p->token == BIBTEX_QUERY_TOKEN_STRING) {
+    value++;
+    length -= 2;
+  }
+  bibtex_grow(query->allocator, &query->strings, &query->strings_cap, query->strings_len + length + 1, 1);
+  for (i = 0; i < length; i++) query->strings[query->strings_len + i] = tolower((unsigned char)value[i]);
+  query->strings[query->strings_len + length] = '\0';
+  size_t op = bibtex_query_emit(query, cmp == BIBTEX_QUERY_TOKEN_CONTAINS ? BIBTEX_QUERY_OP_CONTAINS : BIBTEX_QUERY_OP_EQUAL);
+  query->ops[op].field = field;
+  query->ops[op].cmp = cmp;
+  query->ops[op].string = query->strings_len;
+  query->ops[op].length = length;
+  query->strings_len += length + 1;
+  bibtex_query_next(p);
+  return 0;
+}
+
+static int bibtex_query_or(struct bibtex_query_parser_t* p);
+
+static int bibtex_query_unary(struct bibtex_query_parser_t* p)
+{
+  if (p->token == BIBTEX_QUERY_TOKEN_NOT)
+    {
+      bibtex_query_next(p);
+      if (bibtex_query_unary(p) != 0) return -1;
+      bibtex_query_emit(p->query, BIBTEX_QUERY_OP_NOT);
+      return 0;
+    }
+  if (p->token == BIBTEX_QUERY_TOKEN_LPAREN)
+    {
+      bibtex_query_next(p);
+      if (bibtex_query_or(p) != 0) return -1;
+      if (p->token != BIBTEX_QUERY_TOKEN_RPAREN) return bibtex_query_fail(p, p->start);
+      bibtex_query_next(p);
+      return 0;
+    }
+  if (p->token != BIBTEX_QUERY_TOKEN_ID) return bibtex_query_fail(p, p->start);
+  return bibtex_query_predicate(p);
+}
+
+static int bibtex_query_and(struct bibtex_query_parser_t* p)
+{
+  if (bibtex_query_unary(p) != 0) return -1;
+  while(p->token == BIBTEX_QUERY_TOKEN_AND)
+    {
+      size_t jump = bibtex_query_emit(p->query, BIBTEX_QUERY_OP_JUMP_FALSE);
+      bibtex_query_next(p);
+      if (bibtex_query_unary(p) != 0) return -1;
+      p->query->ops[jump].jump = p->query->len;
+    }
+  return 0;
+}
+
+static int bibtex_query_or(struct bibtex_query_parser_t* p)
+{
+  if (bibtex_query_and(p) != 0) return -1;
+  while(p->token == BIBTEX_QUERY_TOKEN_OR)
+    {
+      size_t jump = bibtex_query_emit(p->query, BIBTEX_QUERY_OP_JUMP_TRUE);
+      bibtex_query_next(p);
+      if (bibtex_query_and(p) != 0) return -1;
+      p->query->ops[jump].jump = p->query->len;
+    }
+  return 0;
+}
+
+struct bibtex_error_t bibtex_query_compile(struct bibtex_query_t** query, const char* text, const struct bibtex_allocator_t* allocator)
+{
+  struct bibtex_query_parser_t p;
+  struct bibtex_query_t* q = bibtex_malloc(allocator, sizeof(struct bibtex_query_t));
+  memset(q, 0, sizeof(struct bibtex_query_t));
+  q->allocator = allocator;
+  memset(&p, 0, sizeof(struct bibtex_query_parser_t));
+  p.query = q;
+  p.text = text;
+  p.pos = text;
+  p.error.type = BIBTEX_OK;
+  bibtex_query_next(&p);
+  // An empty query matches every entry.
+  if (p.token != BIBTEX_QUERY_TOKEN_END && bibtex_query_or(&p) == 0 && p.token != BIBTEX_QUERY_TOKEN_END)
+    bibtex_query_fail(&p, p.start);
+  if (p.error.type != BIBTEX_OK) {
+    bibtex_query_free(q);
+    q = NULL;
+  }
+  *query = q;
+  return p.error;
+}
+
+static void bibtex_query_row_init(struct bibtex_query_row_t* row, const struct bibtex_query_t* query, const struct bibtex_entry_t* entry)
+{
+  const struct bibtex_entry_t* e;
+  row->entry = entry;
+  row->present = 0;
+  row->parsed = 0;
+  row->numeric = 0;
+  if (entry->key != NULL) {
+    row->present |= 1UL << BIBTEX_QUERY_KEY;
+    row->values[BIBTEX_QUERY_KEY] = entry->key;
+  }
+  for (e = entry; e != NULL && (row->present & query->fields) != query->fields; e = e->parent)
+    {
+      const struct bibtex_field_t* field;
+      for (field = e->fields; field != NULL; field = field->next)
+	{
+	  unsigned long bit = 1UL << field->type;
+	  if ((row->present & bit) || field->value == NULL) continue;
+	  if (e != entry && field->type == BIBTEX_FIELD_TYPE_CROSSREF) continue;
+	  row->present |= bit;
+	  row->values[field->type] = field->value;
+	}
+    }
+}
+
+static int bibtex_query_number(struct bibtex_query_row_t* row, int field, long* number)
+{
+  unsigned long bit = 1UL << field;
+  if (!(row->parsed & bit))
+    {
+      row->parsed |= bit;
+      if (row->present & bit) {
+	const char* value = row->values[field];
+	char* end;
+	while(isspace((unsigned char)*value) || *value == '{') value++;
+	row->numbers[field] = strtol(value, &end, 10);
+	if (end != value) row->numeric |= bit;
+      }
+    }
+  *number = row->numbers[field];
+  return (row->numeric & bit) != 0;
+}
+
+static int bibtex_query_contains(const char* value, const char* needle, size_t length)
+{
+  if (length == 0) return 1;
+  for (; *value; value++)
+    {
+      size_t i = 0;
+      while(i < length && tolower((unsigned char)value[i]) == needle[i]) i++;
+      if (i == length) return 1;
+    }
+  return 0;
+}
+
+static int bibtex_query_run(const struct bibtex_query_t* query, struct bibtex_query_row_t* row)
+{
+  int result = 1;
+  size_t pc = 0;
+  long number;
+  while(pc < query->len)
+    {
+      const struct bibtex_query_op_t* op = &query->ops[pc++];
+      int present = (row->present >> op->field) & 1;
+      switch(op->code)
+	{
+	case BIBTEX_QUERY_OP_TYPE:
+	  result = (op->mask >> row->entry->type) & 1;
+	  break;
+	case BIBTEX_QUERY_OP_HAS:
+	  result = (row->present & op->mask) != 0;
+	  break;
+	case BIBTEX_QUERY_OP_NUMBER:
+	  result = bibtex_query_number(row, op->field, &number);
+	  if (result)
+	    switch(op->cmp)
+	      {
+	      case BIBTEX_QUERY_TOKEN_EQ: result = number == op->number; break;
+	      case BIBTEX_QUERY_TOKEN_NE: result = number != op->number; break;
+	      case BIBTEX_QUERY_TOKEN_LT: result = number < op->number; break;
+	      case BIBTEX_QUERY_TOKEN_LE: result = number <= op->number; break;
+	      case BIBTEX_QUERY_TOKEN_GT: result = number > op->number; break;
+	      case BIBTEX_QUERY_TOKEN_GE: result = number >= op->number; break;
+	      default: result = 0; break;
+	      }
+	  break;
+	case BIBTEX_QUERY_OP_EQUAL:
+	  result = present && bibtex_compare_values(row->values[op->field], query->strings + op->string) == (op->cmp == BIBTEX_QUERY_TOKEN_EQ);
+	  break;
+	case BIBTEX_QUERY_OP_CONTAINS:
+	  result = present && bibtex_query_contains(row->values[op->field], query->strings + op->string, op->length);
+	  break;
+	case BIBTEX_QUERY_OP_NOT:
+	  result = !result;
+	  break;
+	case BIBTEX_QUERY_OP_JUMP_FALSE:
+	  if (!result) pc = op->jump;
+	  break;
+	case BIBTEX_QUERY_OP_JUMP_TRUE:
+	  if (result) pc = op->jump;
+	  break;
+	}
+    }
+  return result;
+}
+
+int bibtex_query_match(const struct bibtex_query_t* query, const struct bibtex_entry_t* entry)
+{
+  struct bibtex_query_row_t row;
+  bibtex_query_row_init(&row, query, entry);
+  return bibtex_query_run(query, &row);
+}
+
+static void* bibtex_query_shard_run(void* arg)
+{
+  struct bibtex_query_shard_t* shard = arg;
+  size_t id;
+  for (id = shard->begin; id < shard->end; id++)
+    shard->hits[id] = bibtex_query_match(shard->query, shard->entries[id]);
+  return NULL;
+}
+
+size_t bibtex_query_select(const struct bibtex_query_t* query, const struct bibtex_entry_t* root, int threads, size_t** ids)
+{
+  const struct bibtex_entry_t* e;
+  size_t count = 0, hits = 0;
+  size_t i;
+  for (e = root; e != NULL; e = e->next) count++;
+  if (count == 0) {
+    *ids = NULL;
+    return 0;
+  }
+  const struct bibtex_entry_t** entries = bibtex_malloc(query->allocator, count * sizeof(struct bibtex_entry_t*));
+  unsigned char* matched = bibtex_malloc(query->allocator, count);
+  for (i = 0, e = root; e != NULL; e = e->next) entries[i++] = e;
+
+#ifdef BIBTEX_THREADS
+  if (threads < 1) threads = 1;
+  if ((size_t)threads > count) threads = (int)count;
+#else
+  threads = 1;
+#endif
+  struct bibtex_query_shard_t* shards = bibtex_malloc(query->allocator, threads * sizeof(struct bibtex_query_shard_t));
+  for (i = 0; i < (size_t)threads; i++)
+    {
+      shards[i].query = query;
+      shards[i].entries = entries;
+      shards[i].begin = count * i / threads;
+      shards[i].end = count * (i + 1) / threads;
+      shards[i].hits = matched;
+    }
+#ifdef BIBTEX_THREADS
+  pthread_t* workers = bibtex_malloc(query->allocator, threads * sizeof(pthread_t));
+  int* started = bibtex_malloc(query->allocator, threads * sizeof(int));
+  for (i = 1; i < (size_t)threads; i++)
+    started[i] = pthread_create(&workers[i], NULL, bibtex_query_shard_run, &shards[i]) == 0;
+  bibtex_query_shard_run(&shards[0]);
+  for (i = 1; i < (size_t)threads; i++)
+    {
+      if (started[i]) pthread_join(workers[i], NULL);
+      else bibtex_query_shard_run(&shards[i]);
+    }
+  bibtex_free(query->allocator, workers);
+  bibtex_free(query->allocator, started);
+#else
+  bibtex_query_shard_run(&shards[0]);
+#endif
+
+  for (i = 0; i < count; i++) hits += matched[i];
+  size_t* result = NULL;
+  if (hits > 0) {
+    size_t j = 0;
+    result = bibtex_malloc(query->allocator, hits * sizeof(size_t));
+    for (i = 0; i < count; i++)
+      if (matched[i]) result[j++] = i;
+  }
+  bibtex_free(query->allocator, shards);
+  bibtex_free(query->allocator, matched);
+  bibtex_free(query->allocator, entries);
+  *ids = result;
+  return hits;
+}
+
+void bibtex_query_results_free(const struct bibtex_query_t* query, size_t* ids)
+{
+  bibtex_free(query->allocator, ids);
+}
+
+void bibtex_query_free(struct bibtex_query_t* query)
+{
+  if (query == NULL) return;
+  bibtex_free(query->allocator, query->ops);
+  bibtex_free(query->allocator, query->strings);
+  bibtex_free(query->allocator, query);
 }
 
 const char* bibtex_strerror(enum bibtex_error_type_t type)
@@ -767,6 +2891,8 @@ const char* bibtex_strerror(enum bibtex_error_type_t type)
       return "Empty input";
     case BIBTEX_ERROR_DUPLICATE_FIELD:
       return "Duplicate field";
+    case BIBTEX_ERROR_INVALID_QUERY:
+      return "Invalid query";
     default:
       break;
     }
@@ -872,6 +2998,8 @@ const char* bibtex_field_type_to_string(enum bibtex_field_type_t type)
       return "volume";
     case BIBTEX_FIELD_TYPE_YEAR:
       return "year";
+    case BIBTEX_FIELD_TYPE_CROSSREF:
+      return "crossref";
     default:
       return "Unknown field";
     }
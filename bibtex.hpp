@@ -0,0 +1,477 @@
+#ifndef __BIBTEX_HPP__
+#define __BIBTEX_HPP__
+
+// C++17 wrapper over bibtex.h. The implementation is still compiled as C:
+// define BIBTEX_IMPLEMENTATION in one .c file that includes bibtex.h.
+
+#include "bibtex.h"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace bibtex
+{
+
+inline constexpr std::array<std::pair<std::string_view, bibtex_entry_type_t>, 14> entry_types = {{
+  {"article", BIBTEX_ENTRY_TYPE_ARTICLE},
+  {"book", BIBTEX_ENTRY_TYPE_BOOK},
+  {"booklet", BIBTEX_ENTRY_TYPE_BOOKLET},
+  {"conference", BIBTEX_ENTRY_TYPE_CONFERENCE},
+  {"inbook", BIBTEX_ENTRY_TYPE_INBOOK},
+  {"incollection", BIBTEX_ENTRY_TYPE_INCOLLECTION},
+  {"inproceedings", BIBTEX_ENTRY_TYPE_INPROCEEDINGS},
+  {"manual", BIBTEX_ENTRY_TYPE_MANUAL},
+  {"mastersthesis", BIBTEX_ENTRY_TYPE_MASTERSTHESIS},
+  {"misc", BIBTEX_ENTRY_TYPE_MISC},
+  {"phdthesis", BIBTEX_ENTRY_TYPE_PHDTHESIS},
+  {"proceedings", BIBTEX_ENTRY_TYPE_PROCEEDINGS},
+  {"techreport", BIBTEX_ENTRY_TYPE_TECHREPORT},
+  {"unpublished", BIBTEX_ENTRY_TYPE_UNPUBLISHED},
+}};
+
+inline constexpr std::array<std::pair<std::string_view, bibtex_field_type_t>, 27> field_types = {{
+  {"address", BIBTEX_FIELD_TYPE_ADDRESS},
+  {"annote", BIBTEX_FIELD_TYPE_ANNOTE},
+  {"author", BIBTEX_FIELD_TYPE_AUTHOR},
+  {"booktitle", BIBTEX_FIELD_TYPE_BOOKTITLE},
+  {"chapter", BIBTEX_FIELD_TYPE_CHAPTER},
+  {"doi", BIBTEX_FIELD_TYPE_DOI},
+  {"edition", BIBTEX_FIELD_TYPE_EDITION},
+  {"editor", BIBTEX_FIELD_TYPE_EDITOR},
+  {"howpublished", BIBTEX_FIELD_TYPE_HOWPUBLISHED},
+  {"institution", BIBTEX_FIELD_TYPE_INSTITUTION},
+  {"issn", BIBTEX_FIELD_TYPE_ISSN},
+  {"isbn", BIBTEX_FIELD_TYPE_ISBN},
+  {"journal", BIBTEX_FIELD_TYPE_JOURNAL},
+  {"month", BIBTEX_FIELD_TYPE_MONTH},
+  {"note", BIBTEX_FIELD_TYPE_NOTE},
+  {"number", BIBTEX_FIELD_TYPE_NUMBER},
+  {"organization", BIBTEX_FIELD_TYPE_ORGANIZATION},
+  {"pages", BIBTEX_FIELD_TYPE_PAGES},
+  {"publisher", BIBTEX_FIELD_TYPE_PUBLISHER},
+  {"school", BIBTEX_FIELD_TYPE_SCHOOL},
+  {"type", BIBTEX_FIELD_TYPE_TYPE},
+  {"series", BIBTEX_FIELD_TYPE_SERIES},
+  {"title", BIBTEX_FIELD_TYPE_TITLE},
+  {"url", BIBTEX_FIELD_TYPE_URL},
+  {"volume", BIBTEX_FIELD_TYPE_VOLUME},
+  {"year", BIBTEX_FIELD_TYPE_YEAR},
+  {"crossref", BIBTEX_FIELD_TYPE_CROSSREF},
+}};
+
+namespace detail
+{
+
+constexpr bool equal_nocase(std::string_view a, std::string_view b) noexcept
+{
+  if (a.size() != b.size()) return false;
+  for (std::size_t i = 0; i < a.size(); i++)
+    {
+      char ca = a[i] >= 'A' && a[i] <= 'Z' ? a[i] - 'A' + 'a' : a[i];
+      char cb = b[i] >= 'A' && b[i] <= 'Z' ? b[i] - 'A' + 'a' : b[i];
+      if (ca != cb) return false;
+    }
+  return true;
+}
+
+template <class Table, class Type>
+constexpr std::string_view name_of(const Table& table, Type type) noexcept
+{
+  for (const auto& item : table)
+    if (item.second == type) return item.first;
+  return {};
+}
+
+template <class Table>
+constexpr auto type_of(const Table& table, std::string_view name) noexcept -> std::optional<typename Table::value_type::second_type>
+{
+  for (const auto& item : table)
+    if (equal_nocase(item.first, name)) return item.second;
+  return std::nullopt;
+}
+
+// memory_resource::deallocate needs the size, so every block carries it in front.
+struct alignas(alignof(std::max_align_t)) block_header
+{
+  std::size_t size;
+};
+
+// Pool resources size their bins by the request alone, so keep it a multiple of the alignment.
+constexpr std::size_t block_size(std::size_t size) noexcept
+{
+  return sizeof(block_header) + (size + alignof(block_header) - 1) / alignof(block_header) * alignof(block_header);
+}
+
+inline void* pmr_malloc(void* user, std::size_t size)
+{
+  auto* resource = static_cast<std::pmr::memory_resource*>(user);
+  try
+    {
+      auto* header = static_cast<block_header*>(resource->allocate(block_size(size), alignof(block_header)));
+      header->size = size;
+      return header + 1;
+    }
+  catch (...)
+    {
+      return nullptr;
+    }
+}
+
+inline void pmr_free(void* user, void* ptr)
+{
+  if (ptr == nullptr) return;
+  auto* resource = static_cast<std::pmr::memory_resource*>(user);
+  auto* header = static_cast<block_header*>(ptr) - 1;
+  resource->deallocate(header, block_size(header->size), alignof(block_header));
+}
+
+inline void* pmr_realloc(void* user, void* ptr, std::size_t size)
+{
+  if (ptr == nullptr) return pmr_malloc(user, size);
+  std::size_t old_size = (static_cast<block_header*>(ptr) - 1)->size;
+  if (size <= old_size) return ptr;
+  void* data = pmr_malloc(user, size);
+  if (data == nullptr) return nullptr;
+  std::memcpy(data, ptr, old_size);
+  pmr_free(user, ptr);
+  return data;
+}
+
+// A null resource selects the allocator configured in bibtex.h (BIBTEX_MALLOC and friends).
+class allocator
+{
+public:
+  explicit allocator(std::pmr::memory_resource* resource) noexcept
+    : allocator_{pmr_malloc, pmr_realloc, pmr_free, resource}
+  {
+  }
+
+  const bibtex_allocator_t* get() const noexcept
+  {
+    return allocator_.user != nullptr ? &allocator_ : nullptr;
+  }
+
+private:
+  bibtex_allocator_t allocator_;
+};
+
+} // namespace detail
+
+constexpr std::string_view to_string(bibtex_entry_type_t type) noexcept
+{
+  return detail::name_of(entry_types, type);
+}
+
+constexpr std::string_view to_string(bibtex_field_type_t type) noexcept
+{
+  return detail::name_of(field_types, type);
+}
+
+constexpr std::optional<bibtex_entry_type_t> entry_type_from_string(std::string_view name) noexcept
+{
+  return detail::type_of(entry_types, name);
+}
+
+constexpr std::optional<bibtex_field_type_t> field_type_from_string(std::string_view name) noexcept
+{
+  return detail::type_of(field_types, name);
+}
+
+class error : public std::runtime_error
+{
+public:
+  explicit error(bibtex_error_t error)
+    : std::runtime_error(bibtex_strerror(error.type)), error_(error)
+  {
+  }
+
+  bibtex_error_type_t type() const noexcept { return error_.type; }
+  int row() const noexcept { return error_.row; }
+  int col() const noexcept { return error_.col; }
+
+private:
+  bibtex_error_t error_;
+};
+
+template <class Node, class View>
+class list_iterator
+{
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = View;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = View;
+
+  list_iterator() noexcept = default;
+  list_iterator(Node* node, std::pmr::memory_resource* resource) noexcept : node_(node), resource_(resource) {}
+
+  View operator*() const noexcept { return View(node_, resource_); }
+
+  list_iterator& operator++() noexcept
+  {
+    node_ = node_->next;
+    return *this;
+  }
+
+  list_iterator operator++(int) noexcept
+  {
+    list_iterator it = *this;
+    node_ = node_->next;
+    return it;
+  }
+
+  bool operator==(const list_iterator& other) const noexcept { return node_ == other.node_; }
+  bool operator!=(const list_iterator& other) const noexcept { return node_ != other.node_; }
+
+private:
+  Node* node_ = nullptr;
+  std::pmr::memory_resource* resource_ = nullptr;
+};
+
+template <class Node, class View>
+class list_range
+{
+public:
+  using iterator = list_iterator<Node, View>;
+
+  list_range(Node* head, std::pmr::memory_resource* resource) noexcept : head_(head), resource_(resource) {}
+
+  iterator begin() const noexcept { return iterator(head_, resource_); }
+  iterator end() const noexcept { return iterator(nullptr, resource_); }
+  bool empty() const noexcept { return head_ == nullptr; }
+
+private:
+  Node* head_;
+  std::pmr::memory_resource* resource_;
+};
+
+class field
+{
+public:
+  field(bibtex_field_t* field, std::pmr::memory_resource* resource) noexcept : field_(field), resource_(resource) {}
+
+  bibtex_field_type_t type() const noexcept { return field_->type; }
+  std::string_view name() const noexcept { return to_string(field_->type); }
+  std::string_view value() const noexcept { return field_->value != nullptr ? field_->value : std::string_view(); }
+
+  // Decoded on first use and cached in the field, see bibtex_field_utf8.
+  std::string_view utf8() const
+  {
+    const char* utf8 = bibtex_field_utf8(field_, detail::allocator(resource_).get());
+    return utf8 != nullptr ? utf8 : std::string_view();
+  }
+
+  const bibtex_name_list_t* names() const
+  {
+    return bibtex_field_names(field_, detail::allocator(resource_).get());
+  }
+
+  std::string_view part(bibtex_range_t range) const noexcept { return value().substr(range.start, range.length); }
+
+  bibtex_field_t* get() const noexcept { return field_; }
+
+private:
+  bibtex_field_t* field_;
+  std::pmr::memory_resource* resource_;
+};
+
+class entry
+{
+public:
+  entry(bibtex_entry_t* entry, std::pmr::memory_resource* resource) noexcept : entry_(entry), resource_(resource) {}
+
+  bibtex_entry_type_t type() const noexcept { return entry_->type; }
+  std::string_view type_name() const noexcept { return to_string(entry_->type); }
+  std::string_view key() const noexcept { return entry_->key != nullptr ? entry_->key : std::string_view(); }
+  list_range<bibtex_field_t, field> fields() const noexcept { return {entry_->fields, resource_}; }
+
+  // Looks in the crossref parents too, see bibtex_entry_field.
+  std::optional<field> find(bibtex_field_type_t type) const noexcept
+  {
+    bibtex_field_t* f = bibtex_entry_field(entry_, type);
+    if (f == nullptr) return std::nullopt;
+    return field(f, resource_);
+  }
+
+  std::optional<entry> parent() const noexcept
+  {
+    if (entry_->parent == nullptr) return std::nullopt;
+    return entry(entry_->parent, resource_);
+  }
+
+  bibtex_entry_t* get() const noexcept { return entry_; }
+
+private:
+  bibtex_entry_t* entry_;
+  std::pmr::memory_resource* resource_;
+};
+
+// Compiled filter, usable as a predicate over entries. The program is small and
+// outlives any one library, so it always uses the bibtex.h allocator.
+class query
+{
+public:
+  explicit query(const char* text)
+  {
+    bibtex_error_t err = bibtex_query_compile(&query_, text, nullptr);
+    if (err.type != BIBTEX_OK) throw error(err);
+  }
+
+  explicit query(const std::string& text) : query(text.c_str()) {}
+
+  query(const query&) = delete;
+  query& operator=(const query&) = delete;
+  query(query&& other) noexcept : query_(std::exchange(other.query_, nullptr)) {}
+
+  query& operator=(query&& other) noexcept
+  {
+    if (this != &other)
+      {
+	bibtex_query_free(query_);
+	query_ = std::exchange(other.query_, nullptr);
+      }
+    return *this;
+  }
+
+  ~query() { bibtex_query_free(query_); }
+
+  bool operator()(entry e) const noexcept { return bibtex_query_match(query_, e.get()) != 0; }
+
+  const bibtex_query_t* get() const noexcept { return query_; }
+
+private:
+  bibtex_query_t* query_ = nullptr;
+};
+
+class library
+{
+public:
+  using iterator = list_iterator<bibtex_entry_t, entry>;
+
+  library() noexcept = default;
+  explicit library(std::pmr::memory_resource* resource) noexcept : resource_(resource) {}
+
+  library(const library&) = delete;
+  library& operator=(const library&) = delete;
+
+  library(library&& other) noexcept
+    : root_(std::exchange(other.root_, nullptr)), hidden_(std::exchange(other.hidden_, nullptr)), resource_(other.resource_),
+      resolved_(std::exchange(other.resolved_, false)), min_crossrefs_(other.min_crossrefs_)
+  {
+  }
+
+  library& operator=(library&& other) noexcept
+  {
+    if (this != &other)
+      {
+	reset();
+	root_ = std::exchange(other.root_, nullptr);
+	hidden_ = std::exchange(other.hidden_, nullptr);
+	resource_ = other.resource_;
+	resolved_ = std::exchange(other.resolved_, false);
+	min_crossrefs_ = other.min_crossrefs_;
+      }
+    return *this;
+  }
+
+  ~library() { reset(); }
+
+  // Without a resource the library allocates like bibtex_parse.
+  static library parse(const char* input, bibtex_error_t& error, std::pmr::memory_resource* resource = nullptr) noexcept
+  {
+    library lib(resource);
+    error = bibtex_parse_with(&lib.root_, input, detail::allocator(resource).get());
+    return lib;
+  }
+
+  static library parse(const char* input, std::pmr::memory_resource* resource = nullptr)
+  {
+    bibtex_error_t err;
+    library lib = parse(input, err, resource);
+    if (err.type != BIBTEX_OK) throw error(err);
+    return lib;
+  }
+
+  static library parse(const std::string& input, std::pmr::memory_resource* resource = nullptr)
+  {
+    return parse(input.c_str(), resource);
+  }
+
+  // Keeps only the entries matching filter, the others are freed as soon as they are parsed.
+  static library parse(const char* input, const query& filter, std::pmr::memory_resource* resource = nullptr)
+  {
+    library lib(resource);
+    bibtex_error_t err = bibtex_parse_query(&lib.root_, input, filter.get(), detail::allocator(resource).get());
+    if (err.type != BIBTEX_OK) throw error(err);
+    return lib;
+  }
+
+  iterator begin() const noexcept { return iterator(root_, resource_); }
+  iterator end() const noexcept { return iterator(nullptr, resource_); }
+  list_range<bibtex_entry_t, entry> entries() const noexcept { return {root_, resource_}; }
+  list_range<bibtex_entry_t, entry> hidden() const noexcept { return {hidden_, resource_}; }
+  bool empty() const noexcept { return root_ == nullptr; }
+
+  // Moves the entries of other into this library, both must use the same resource.
+  // Hidden parents take part in deduplication, and crossrefs are resolved again if
+  // either library had resolved them.
+  std::size_t merge(library&& other, bibtex_merge_policy_t policy = BIBTEX_MERGE_KEEP_FIRST)
+  {
+    if (other.resource_ != resource_) throw std::invalid_argument("bibtex::library::merge: different memory resources");
+    bool resolved = resolved_ || other.resolved_;
+    bibtex_entry_t* libraries[2] = {join(root_, std::exchange(hidden_, nullptr)),
+				    join(std::exchange(other.root_, nullptr), std::exchange(other.hidden_, nullptr))};
+    other.resolved_ = false;
+    std::size_t dropped = bibtex_merge(&root_, libraries, 2, policy, detail::allocator(resource_).get());
+    if (resolved) resolve_crossrefs(resolved_ ? min_crossrefs_ : other.min_crossrefs_);
+    return dropped;
+  }
+
+  std::size_t resolve_crossrefs(std::size_t min_crossrefs = 0)
+  {
+    resolved_ = true;
+    min_crossrefs_ = min_crossrefs;
+    return bibtex_crossref_resolve(&root_, &hidden_, min_crossrefs, detail::allocator(resource_).get());
+  }
+
+  void reset() noexcept
+  {
+    detail::allocator allocator(resource_);
+    bibtex_entry_free_with(root_, allocator.get());
+    bibtex_entry_free_with(hidden_, allocator.get());
+    root_ = nullptr;
+    hidden_ = nullptr;
+    resolved_ = false;
+  }
+
+  bibtex_entry_t* get() const noexcept { return root_; }
+  std::pmr::memory_resource* resource() const noexcept { return resource_; }
+
+private:
+  static bibtex_entry_t* join(bibtex_entry_t* list, bibtex_entry_t* rest) noexcept
+  {
+    bibtex_entry_t** tail = &list;
+    while (*tail != nullptr) tail = &(*tail)->next;
+    *tail = rest;
+    return list;
+  }
+
+  bibtex_entry_t* root_ = nullptr;
+  bibtex_entry_t* hidden_ = nullptr;
+  std::pmr::memory_resource* resource_ = nullptr;
+  bool resolved_ = false;
+  std::size_t min_crossrefs_ = 0;
+};
+
+} // namespace bibtex
+
+#endif // __BIBTEX_HPP__
@@ -0,0 +1,77 @@
+// Table-driven tests for bibtex_field_names.
+//
+//   $ cc -g -fsanitize=address -I. tests/field_names.c -o field_names
+//   $ ./field_names
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+// Every name is written as first|von|last|jr, names are separated by "; ".
+static const struct { const char* value; const char* expect; } cases[] = {
+  { "", "" },
+  { "Plato", "||Plato|" },
+  { "Donald E. Knuth", "Donald E.||Knuth|" },
+  { "Knuth, Donald E.", "Donald E.||Knuth|" },
+  { "Brinch Hansen, Per", "Per||Brinch Hansen|" },
+  { "Per Brinch~Hansen", "Per Brinch||Hansen|" },
+  { "Ludwig van Beethoven", "Ludwig|van|Beethoven|" },
+  { "de la Fontaine, Jean", "Jean|de la|Fontaine|" },
+  { "Ford, Jr., Henry", "Henry||Ford|Jr." },
+  { "Charles Louis Xavier Joseph de la Vall{\\'e}e Poussin", "Charles Louis Xavier Joseph|de la|Vall{\\'e}e Poussin|" },
+  { "andrew andersson", "|andrew|andersson|" },
+  // Special characters take the case of their control sequence.
+  { "{\\v{S}}ivic {\\ss}ab {\\AA}berg {\\c c}a {\\\"{u}}ber X", "{\\v{S}}ivic|{\\ss}ab {\\AA}berg {\\c c}a {\\\"{u}}ber|X|" },
+  // Only "and" at brace depth 0, between words, separates names.
+  { "{Barnes and Noble, Inc.}", "||{Barnes and Noble, Inc.}|" },
+  { "Jean-Paul Sartre and others", "Jean-Paul||Sartre|; ||others|" },
+  { "andrew andersson and Anderson", "|andrew|andersson|; ||Anderson|" },
+  { "  Alpha  AND beta, gamma ", "||Alpha|; gamma||beta|" },
+  { "{\\'E}mile Zola and M{\\\"u}ller, Hans", "{\\'E}mile||Zola|; Hans||M{\\\"u}ller|" },
+  { "Ludwig van Beethoven and de la Fontaine, Jean and Ford, Jr., Henry",
+    "Ludwig|van|Beethoven|; Jean|de la|Fontaine|; Henry||Ford|Jr." },
+};
+
+static void append(char* out, size_t size, const char* value, bibtex_range_t range, const char* sep)
+{
+  size_t len = strlen(out);
+  snprintf(out + len, size - len, "%.*s%s", (int)range.length, value + range.start, sep);
+}
+
+int main(void)
+{
+  int failed = 0;
+  size_t i, j;
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+      char input[256];
+      char got[256] = "";
+      bibtex_entry_t* root;
+      snprintf(input, sizeof(input), "@misc{k, author = \"%s\"}", cases[i].value);
+      if (bibtex_parse(&root, input).type != BIBTEX_OK) {
+	fprintf(stderr, "FAIL: %s does not parse\n", input);
+	failed++;
+	continue;
+      }
+      bibtex_field_t* field = root->fields;
+      const bibtex_name_list_t* list = bibtex_field_names(field, NULL);
+      for (j = 0; j < list->count; j++)
+	{
+	  const bibtex_name_t* name = &list->names[j];
+	  append(got, sizeof(got), field->value, name->first, "|");
+	  append(got, sizeof(got), field->value, name->von, "|");
+	  append(got, sizeof(got), field->value, name->last, "|");
+	  append(got, sizeof(got), field->value, name->jr, j + 1 < list->count ? "; " : "");
+	}
+      if (strcmp(got, cases[i].expect) != 0) {
+	fprintf(stderr, "FAIL: %s splits into %s, expected %s\n", cases[i].value, got, cases[i].expect);
+	failed++;
+      }
+      if (bibtex_field_names(field, NULL) != list) {
+	fprintf(stderr, "FAIL: %s is not cached\n", cases[i].value);
+	failed++;
+      }
+      bibtex_entry_free(root);
+    }
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}
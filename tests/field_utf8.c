@@ -0,0 +1,69 @@
+// Table-driven tests for bibtex_field_utf8.
+//
+//   $ cc -g -fsanitize=address -I. tests/field_utf8.c -o field_utf8
+//   $ ./field_utf8
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+struct utf8_case_t {
+    const char* field;
+    const char* value; // as written between the quotes of the .bib file
+    const char* expect;
+    int verbatim; // returned as is, without a copy
+};
+
+static const struct utf8_case_t cases[] = {
+  { "title", "Plain ASCII title", "Plain ASCII title", 1 },
+  { "author", "M{\\\"u}ller", "Müller", 0 },
+  { "author", "Fran{\\c c}ois \\'{E}mile", "François Émile", 0 },
+  { "author", "Pa\\l{}ka and Stra{\\ss}e", "Pałka and Straße", 0 },
+  { "author", "Erd\\H{o}s and \\v{S}ivic", "Erdős and Šivic", 0 },
+  { "author", "{\\'\\i}\\AA{}ngstr{\\\"o}m", "íÅngström", 0 },
+  { "title", "{NASA} and {DNA}", "NASA and DNA", 0 },
+  { "pages", "1--10", "1\xE2\x80\x93" "10", 0 },
+  { "note", "see --- ``quote''", "see \xE2\x80\x94 \xE2\x80\x9Cquote\xE2\x80\x9D", 0 },
+  { "note", "and~x \\& \\emph{bold}", "and\xC2\xA0x & bold", 0 },
+  // Accents on a multi-byte base combine with the whole character.
+  { "title", "{\\'\xC3\xA9}t", "\xC3\xA9\xCC\x81t", 0 },
+  { "title", "{\\~\xC3\xB1}", "\xC3\xB1\xCC\x83", 0 },
+  { "title", "{\\\"{\xE2\x82\xAC}}", "\xE2\x82\xAC\xCC\x88", 0 },
+  // URLs and DOIs are not TeX.
+  { "url", "http://x.org/~me/a--b", "http://x.org/~me/a--b", 1 },
+  { "doi", "10.1/a~b", "10.1/a~b", 1 },
+  { "url", "http://x.org/{\\\"u}", "http://x.org/{\\\"u}", 1 },
+};
+
+int main(void)
+{
+  int failed = 0;
+  size_t i;
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+      char input[256];
+      bibtex_entry_t* root;
+      snprintf(input, sizeof(input), "@misc{k, %s = \"%s\"}", cases[i].field, cases[i].value);
+      bibtex_error_t error = bibtex_parse(&root, input);
+      if (error.type != BIBTEX_OK) {
+	fprintf(stderr, "FAIL: %s does not parse\n", input);
+	failed++;
+	continue;
+      }
+      const char* utf8 = bibtex_field_utf8(root->fields, NULL);
+      if (strcmp(utf8, cases[i].expect) != 0) {
+	fprintf(stderr, "FAIL: %s decodes to %s, expected %s\n", cases[i].value, utf8, cases[i].expect);
+	failed++;
+      }
+      if ((utf8 == root->fields->value) != cases[i].verbatim) {
+	fprintf(stderr, "FAIL: %s is %s\n", cases[i].value, cases[i].verbatim ? "copied" : "not decoded into a copy");
+	failed++;
+      }
+      if (bibtex_field_utf8(root->fields, NULL) != utf8) {
+	fprintf(stderr, "FAIL: %s is not cached\n", cases[i].value);
+	failed++;
+      }
+      bibtex_entry_free(root);
+    }
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}
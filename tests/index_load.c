@@ -0,0 +1,97 @@
+// Regression test for bibtex_index_load on truncated and corrupted files.
+//
+//   $ cc -g -fsanitize=address -I. tests/index_load.c -o index_load
+//   $ ./index_load
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+static int check(int ok, const char* what)
+{
+  if (!ok) fprintf(stderr, "FAIL: %s\n", what);
+  return ok ? 0 : 1;
+}
+
+static void* failing_malloc(void* user, size_t size)
+{
+  (void)user;
+  (void)size;
+  return NULL;
+}
+
+static void* failing_realloc(void* user, void* ptr, size_t size)
+{
+  (void)user;
+  (void)ptr;
+  (void)size;
+  return NULL;
+}
+
+static void failing_free(void* user, void* ptr)
+{
+  (void)user;
+  free(ptr);
+}
+
+// Loads the first len bytes of a saved index, with byte at (if any) replaced by value.
+static int load_bytes(const unsigned char* data, size_t len, long at, unsigned char value, const bibtex_allocator_t* allocator)
+{
+  bibtex_index_t index;
+  FILE* file = tmpfile();
+  int result;
+  fwrite(data, 1, len, file);
+  if (at >= 0) {
+    fseek(file, at, SEEK_SET);
+    fputc(value, file);
+  }
+  rewind(file);
+  result = bibtex_index_load(&index, file, allocator);
+  if (result == 0) {
+    size_t* ids;
+    bibtex_index_search(&index, "graph", BIBTEX_FIELD_MASK_ALL, BIBTEX_INDEX_OR, &ids);
+    bibtex_index_results_free(&index, ids);
+    bibtex_index_free(&index);
+  }
+  fclose(file);
+  return result;
+}
+
+int main(void)
+{
+  bibtex_entry_t* root;
+  bibtex_index_t index;
+  unsigned char data[4096];
+  size_t len, i;
+  long field;
+  int failed = 0;
+  bibtex_allocator_t failing = { failing_malloc, failing_realloc, failing_free, NULL };
+  FILE* file = tmpfile();
+
+  bibtex_parse(&root, "@misc{a, title=\"graph theory\"}@misc{b, title=\"graph\"}@misc{c, note=\"theory graph\"}");
+  bibtex_index_build(&index, root, BIBTEX_FIELD_MASK_ALL, 1, NULL);
+  bibtex_index_save(&index, file);
+  bibtex_index_free(&index);
+  bibtex_entry_free(root);
+  rewind(file);
+  len = fread(data, 1, sizeof(data), file);
+  fclose(file);
+
+  failed += check(load_bytes(data, len, -1, 0, NULL) == 0, "saved index loads");
+  failed += check(load_bytes(data, len, -1, 0, &failing) == -1, "allocation failure is reported");
+  for (i = 0; i < len; i++)
+    if (load_bytes(data, i, -1, 0, NULL) != -1) {
+      failed += check(0, "truncated index is rejected");
+      break;
+    }
+  // Every byte of term_count, strings_len and postings_len, set to something too large.
+  for (field = 16; field < 40; field++)
+    {
+      if (load_bytes(data, len, field, 0xff, NULL) != -1) {
+	failed += check(0, "oversized header is rejected");
+	break;
+      }
+    }
+  failed += check(load_bytes(data, len, 0, 'X', NULL) == -1, "bad magic is rejected");
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}
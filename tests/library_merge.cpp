@@ -0,0 +1,60 @@
+// Regression test for bibtex::library::merge dropping a resolved crossref parent.
+//
+//   $ cc -c -g -fsanitize=address -x c - -o bibtex.o <<< '#define BIBTEX_IMPLEMENTATION
+//   #include "bibtex.h"'
+//   $ c++ -std=c++17 -g -fsanitize=address -I. tests/library_merge.cpp bibtex.o -o library_merge
+//   $ ./library_merge
+
+#include "bibtex.hpp"
+
+#include <cstdio>
+#include <memory_resource>
+
+static int check(bool ok, const char* what)
+{
+  if (!ok) std::fprintf(stderr, "FAIL: %s\n", what);
+  return ok ? 0 : 1;
+}
+
+static int merge_dropped_parent(std::pmr::memory_resource* resource)
+{
+  int failed = 0;
+  auto a = bibtex::library::parse("@proceedings{proc, title = \"Proceedings\"}", resource);
+  auto b = bibtex::library::parse("@proceedings{proc, publisher = \"Publisher\"}"
+				  "@inproceedings{child, crossref = \"proc\"}", resource);
+  b.resolve_crossrefs();
+  failed += check(a.merge(std::move(b), BIBTEX_MERGE_FIELDS) == 1, "one duplicate dropped");
+  for (bibtex::entry e : a)
+    {
+      if (e.key() != "child") continue;
+      auto publisher = e.find(BIBTEX_FIELD_TYPE_PUBLISHER);
+      failed += check(publisher && publisher->value() == "Publisher", "child inherits from the kept parent");
+      failed += check(e.parent() && e.parent()->get() == a.get(), "child points at the kept parent");
+    }
+  return failed;
+}
+
+static int merge_hidden_parent()
+{
+  int failed = 0;
+  auto a = bibtex::library::parse("@proceedings{proc, title = \"Proceedings\"}");
+  auto b = bibtex::library::parse("@proceedings{proc, publisher = \"Publisher\"}"
+				  "@inproceedings{child, crossref = \"proc\"}");
+  b.resolve_crossrefs(2);
+  failed += check(b.hidden().begin() != b.hidden().end(), "parent hidden before merge");
+  failed += check(a.merge(std::move(b), BIBTEX_MERGE_FIELDS) == 1, "hidden duplicate dropped");
+  std::size_t hidden = 0;
+  for (bibtex::entry e : a.hidden()) hidden += e.key() == "proc";
+  failed += check(hidden == 1, "parent hidden again after merge");
+  for (bibtex::entry e : a)
+    if (e.key() == "child") failed += check(e.find(BIBTEX_FIELD_TYPE_PUBLISHER).has_value(), "child inherits from the hidden parent");
+  return failed;
+}
+
+int main()
+{
+  std::pmr::unsynchronized_pool_resource pool;
+  int failed = merge_dropped_parent(nullptr) + merge_dropped_parent(&pool) + merge_hidden_parent();
+  if (failed == 0) std::puts("ok");
+  return failed != 0;
+}
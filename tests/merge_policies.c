@@ -0,0 +1,54 @@
+// Regression test: which entries bibtex_merge drops must not depend on the merge policy.
+//
+//   $ cc -g -fsanitize=address -I. tests/merge_policies.c -o merge_policies
+//   $ ./merge_policies
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+static int check(int ok, const char* what, const char* policy)
+{
+  if (!ok) fprintf(stderr, "FAIL: %s (%s)\n", what, policy);
+  return ok ? 0 : 1;
+}
+
+struct merge_case_t {
+    bibtex_merge_policy_t policy;
+    const char* name;
+    const char* key;
+    const char* title;
+};
+
+static const struct merge_case_t cases[] = {
+  { BIBTEX_MERGE_KEEP_FIRST, "keep first", "a", NULL },
+  { BIBTEX_MERGE_KEEP_LAST, "keep last", "a", "again" },
+  { BIBTEX_MERGE_FIELDS, "fields", "a", "again" },
+};
+
+int main(void)
+{
+  const char* inputs[] = {
+    "@article{a, doi = \"10.1/x\"}",
+    "@article{b, doi = \"10.1/x\"}",
+    "@article{a, title = \"again\"}",
+  };
+  int failed = 0;
+  size_t c, i;
+  for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+      bibtex_entry_t* libraries[3];
+      bibtex_entry_t* merged;
+      bibtex_field_t* title;
+      for (i = 0; i < 3; i++) bibtex_parse(&libraries[i], inputs[i]);
+      failed += check(bibtex_merge(&merged, libraries, 3, cases[c].policy, NULL) == 2, "two duplicates dropped", cases[c].name);
+      failed += check(merged != NULL && merged->next == NULL, "one entry left", cases[c].name);
+      if (merged == NULL) continue;
+      failed += check(strcmp(merged->key, cases[c].key) == 0, "kept citekey", cases[c].name);
+      title = bibtex_entry_field(merged, BIBTEX_FIELD_TYPE_TITLE);
+      if (cases[c].title == NULL) failed += check(title == NULL, "no title", cases[c].name);
+      else failed += check(title != NULL && strcmp(title->value, cases[c].title) == 0, "kept title", cases[c].name);
+      bibtex_entry_free(merged);
+    }
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}
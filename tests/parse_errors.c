@@ -0,0 +1,62 @@
+// Every allocation made while parsing malformed input is freed again.
+//
+//   $ cc -g -fsanitize=address -I. tests/parse_errors.c -o parse_errors
+//   $ ./parse_errors
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+static void* counting_malloc(void* user, size_t size)
+{
+  ++*(long*)user;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* user, void* ptr, size_t size)
+{
+  if (ptr == NULL) ++*(long*)user;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void* user, void* ptr)
+{
+  --*(long*)user;
+  free(ptr);
+}
+
+static const char* inputs[] = {
+  "@db\"3&ii",
+  "@article{key\"",
+  "@article{key, title\"",
+  "@article{key, title = \"abc\"\"",
+  "@article{key, year = 1990\"",
+  "@article{key, title = \"unterminated",
+  "@article{key, title = \"a\", title = \"b\"}",
+  "@article{key, title = \"a\"}@article{key, title = \"b\"}",
+  "@nonsense{key}",
+  "@article{key, nonsense = \"a\"}",
+};
+
+int main(void)
+{
+  int failed = 0;
+  size_t i;
+  for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+    {
+      long live = 0;
+      bibtex_allocator_t allocator = { counting_malloc, counting_realloc, counting_free, &live };
+      bibtex_entry_t* root = NULL;
+      bibtex_error_t error = bibtex_parse_with(&root, inputs[i], &allocator);
+      if (error.type == BIBTEX_OK) {
+	fprintf(stderr, "FAIL: %s parsed\n", inputs[i]);
+	failed++;
+      }
+      bibtex_entry_free_with(root, &allocator);
+      if (live != 0) {
+	fprintf(stderr, "FAIL: %s leaks %ld allocations\n", inputs[i], live);
+	failed++;
+      }
+    }
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}
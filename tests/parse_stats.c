@@ -0,0 +1,63 @@
+// bibtex_parse_stats counts exactly the allocations the allocator sees, citekey index included.
+//
+//   $ cc -g -fsanitize=address -DBIBTEX_STATS -I. tests/parse_stats.c -o parse_stats
+//   $ ./parse_stats
+
+#ifndef BIBTEX_STATS
+#define BIBTEX_STATS
+#endif
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+struct counts_t {
+    size_t allocations;
+    size_t bytes;
+};
+
+static void* counting_malloc(void* user, size_t size)
+{
+  struct counts_t* counts = user;
+  counts->allocations++;
+  counts->bytes += size;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* user, void* ptr, size_t size)
+{
+  struct counts_t* counts = user;
+  if (ptr == NULL) {
+    counts->allocations++;
+    counts->bytes += size;
+  }
+  return realloc(ptr, size);
+}
+
+static void counting_free(void* user, void* ptr)
+{
+  (void)user;
+  free(ptr);
+}
+
+int main(void)
+{
+  // Enough entries for the citekey index to grow a few times.
+  char input[64 * 1024];
+  size_t len = 0;
+  int i;
+  for (i = 0; i < 500; i++)
+    len += snprintf(input + len, sizeof(input) - len, "@article{key%d, title = \"Title %d\", year = %d}\n", i, i, 1950 + i % 70);
+  struct counts_t counts = { 0, 0 };
+  bibtex_allocator_t allocator = { counting_malloc, counting_realloc, counting_free, &counts };
+  bibtex_entry_t* root;
+  bibtex_stats_t stats;
+  bibtex_error_t error = bibtex_parse_stats(&root, input, &allocator, &stats);
+  int failed = error.type != BIBTEX_OK || stats.entries != 500;
+  if (stats.allocations != counts.allocations || stats.bytes_allocated != counts.bytes) {
+    fprintf(stderr, "FAIL: stats report %zu allocations (%zu bytes), allocator saw %zu (%zu bytes)\n",
+	    stats.allocations, stats.bytes_allocated, counts.allocations, counts.bytes);
+    failed = 1;
+  }
+  bibtex_entry_free_with(root, &allocator);
+  if (failed == 0) puts("ok");
+  return failed;
+}
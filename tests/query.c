@@ -0,0 +1,157 @@
+// Table-driven tests for the query language: precedence, short-circuiting jumps, the two
+// meanings of `type`, error columns, and bibtex_parse_query against bibtex_query_select.
+//
+//   $ cc -g -fsanitize=address -I. tests/query.c -o query
+//   $ ./query
+
+#define BIBTEX_IMPLEMENTATION
+#include "bibtex.h"
+
+// Matches as a string of '0'/'1', one per entry, or NULL when the query does not compile.
+static int check_select(const bibtex_entry_t* root, const char* text, const char* expect)
+{
+  bibtex_query_t* query;
+  bibtex_error_t error = bibtex_query_compile(&query, text, NULL);
+  char got[16];
+  size_t* ids;
+  size_t count, i, k = 0;
+  const bibtex_entry_t* e;
+  if (error.type != BIBTEX_OK) {
+    fprintf(stderr, "FAIL: %s does not compile (col %d)\n", text, error.col);
+    return 1;
+  }
+  count = bibtex_query_select(query, root, 2, &ids);
+  for (i = 0, e = root; e != NULL && i + 1 < sizeof(got); e = e->next, i++)
+    {
+      got[i] = k < count && ids[k] == i ? '1' : '0';
+      if (got[i] == '1') k++;
+      if ((bibtex_query_match(query, e) != 0) != (got[i] == '1')) {
+	fprintf(stderr, "FAIL: %s: bibtex_query_match disagrees on entry %zu\n", text, i);
+	return 1;
+      }
+    }
+  got[i] = '\0';
+  bibtex_query_results_free(query, ids);
+  bibtex_query_free(query);
+  if (strcmp(got, expect) != 0) {
+    fprintf(stderr, "FAIL: %s selects %s, expected %s\n", text, got, expect);
+    return 1;
+  }
+  return 0;
+}
+
+// Entry i has a title if bit 0 is set, a note if bit 1 is set and a year if bit 2 is set,
+// so every row below is the truth table of the query over title, note and year.
+static const struct { const char* text; const char* expect; } logic[] = {
+  { "title and not note", "01000100" },
+  { "title or note and year", "01010111" },
+  { "(title or note) and year", "00000111" },
+  { "title and note or year", "00011111" },
+  { "not title or note", "10111011" },
+  { "not (title and note)", "11101110" },
+  { "title || note && !year", "01110101" },
+  { "!(title || note) || year && title", "10001101" },
+  { "title and (note or not year) and not note", "01000000" },
+  { "", "11111111" },
+};
+
+static const struct { const char* text; const char* expect; } types[] = {
+  { "type == article", "100" },
+  { "type == \"article\"", "010" },
+  { "type in {article, book}", "101" },
+  { "type != misc", "101" },
+  { "type ~ \"ART\"", "010" },
+  { "type", "010" },
+};
+
+static const struct { const char* text; int col; } errors[] = {
+  { "year >=", 8 },
+  { "year > \"x\"", 8 },
+  { "type in {article, foo}", 19 },
+  { "type in article", 9 },
+  { "bogus == 1", 1 },
+  { "(year", 6 },
+  { "year 2015", 6 },
+  { "and year", 1 },
+  { "year == 1 or", 13 },
+  { "not", 4 },
+  { "title ~ \"abc", 9 },
+  { "title & note", 7 },
+};
+
+static int check_parse_query(const char* input, const char* text, bibtex_error_type_t expect, int row, int col)
+{
+  bibtex_query_t* query;
+  bibtex_entry_t* filtered;
+  bibtex_entry_t* all;
+  bibtex_error_t error;
+  int failed = 0;
+  bibtex_query_compile(&query, text, NULL);
+  error = bibtex_parse_query(&filtered, input, query, NULL);
+  if (error.type != expect || (expect != BIBTEX_OK && (error.row != row || error.col != col || filtered != NULL))) {
+    fprintf(stderr, "FAIL: parsing %s with %s: error %d at %d:%d\n", input, text, error.type, error.row, error.col);
+    failed = 1;
+  } else if (expect == BIBTEX_OK && bibtex_parse(&all, input).type == BIBTEX_OK) {
+    // Without duplicates, filtering while parsing keeps exactly what bibtex_query_select picks.
+    size_t* ids;
+    size_t count = bibtex_query_select(query, all, 1, &ids), i = 0, k = 0;
+    const bibtex_entry_t* e;
+    const bibtex_entry_t* kept = filtered;
+    for (e = all; e != NULL; e = e->next, i++)
+      {
+	if (k >= count || ids[k] != i) continue;
+	k++;
+	if (kept == NULL || strcmp(kept->key, e->key) != 0) break;
+	kept = kept->next;
+      }
+    if (e != NULL || kept != NULL) {
+      fprintf(stderr, "FAIL: parsing %s with %s keeps other entries than bibtex_query_select\n", input, text);
+      failed = 1;
+    }
+    bibtex_query_results_free(query, ids);
+    bibtex_entry_free(all);
+  }
+  bibtex_entry_free(filtered);
+  bibtex_query_free(query);
+  return failed;
+}
+
+int main(void)
+{
+  char input[1024];
+  size_t len = 0, i;
+  bibtex_entry_t* root;
+  int failed = 0;
+
+  for (i = 0; i < 8; i++)
+    len += snprintf(input + len, sizeof(input) - len, "@misc{k%zu,%s%s%s}\n", i,
+		    i & 1 ? " title = \"t\"," : "", i & 2 ? " note = \"n\"," : "", i & 4 ? " year = 2000," : "");
+  bibtex_parse(&root, input);
+  for (i = 0; i < sizeof(logic) / sizeof(logic[0]); i++) failed += check_select(root, logic[i].text, logic[i].expect);
+  bibtex_entry_free(root);
+
+  bibtex_parse(&root, "@article{a, title = \"x\"}@misc{b, type = \"Article\"}@book{c, title = \"y\"}");
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) failed += check_select(root, types[i].text, types[i].expect);
+  bibtex_entry_free(root);
+
+  for (i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+    {
+      bibtex_query_t* query = NULL;
+      bibtex_error_t error = bibtex_query_compile(&query, errors[i].text, NULL);
+      if (error.type != BIBTEX_ERROR_INVALID_QUERY || error.row != 1 || error.col != errors[i].col || query != NULL) {
+	fprintf(stderr, "FAIL: %s: error %d at col %d, expected col %d\n", errors[i].text, error.type, error.col, errors[i].col);
+	failed++;
+	bibtex_query_free(query);
+      }
+    }
+
+  // Duplicate citekeys only count among kept entries; the error points at the second kept key.
+  failed += check_parse_query("@article{a, year = 2020}@misc{b, year = 1}@article{c, year = 2010}@book{d, year = 2021}",
+			      "type in {article, book} and year >= 2015", BIBTEX_OK, 0, 0);
+  failed += check_parse_query("@misc{a, year = 2020}@article{a, year = 2020}", "type == article", BIBTEX_OK, 0, 0);
+  failed += check_parse_query("@article{a, year = 2020}@misc{A, year = 2020}", "type == article", BIBTEX_OK, 0, 0);
+  failed += check_parse_query("@article{a, year = 2020}\n@article{A, year = 2021}", "type == article",
+			      BIBTEX_ERROR_DUPLICATE_CITEKEY, 2, 10);
+  if (failed == 0) puts("ok");
+  return failed != 0;
+}